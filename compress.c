@@ -0,0 +1,397 @@
+/*
+ * Transparent LZ4 compression of file data
+ *
+ * A compressed file is cut into clusters of NIZI_FS_CLUSTER_BLOCKS blocks, a
+ * fixed 4 KiB so an image reads the same under any page size; a page holds one
+ * or more clusters. At writeback a cluster is compressed, and if that saves at
+ * least one block it is stored as a header and the LZ4 stream in the first
+ * blocks of the cluster, with NIZI_FS_CLUSTER_COMPRESSED(c) set in the file
+ * entry. Otherwise it is stored raw. Pages of compressed files never get
+ * buffer heads, the clusters are read and written here as a whole: a raw
+ * cluster straight from/to the page, a compressed one through a bounce page.
+ */
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>      /* grab_cache_page_write_begin, ... */
+#include <linux/highmem.h>      /* kmap, kunmap */
+#include <linux/slab.h>         /* kmalloc, kfree */
+#include <linux/gfp.h>          /* alloc_page, __free_page */
+#include <linux/writeback.h>    /* struct writeback_control */
+#include <linux/bitops.h>       /* hweight32 */
+#include <linux/lz4.h>
+#include "nizifs.h"
+#include "real_io.h"
+
+typedef struct nizifs_cluster_header {
+    byte4_t clen;                       /* bytes of LZ4 stream following the header */
+} nizifs_cluster_header_t;
+
+#define NIZI_FS_CLUSTER_HDR sizeof(nizifs_cluster_header_t)
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0))
+static int nizifs_lz4_compress(const char *src, int len, char *dst, int max, void *wrkmem) {
+    size_t dlen = max;
+    if (lz4_compress(src, len, dst, &dlen, wrkmem) < 0 || dlen > max)
+        return 0;
+    return dlen;
+}
+static int nizifs_lz4_decompress(const char *src, int clen, char *dst, int max) {
+    size_t dlen = max;
+    if (lz4_decompress_unknownoutputsize(src, clen, dst, &dlen) < 0)
+        return -EIO;
+    return dlen;
+}
+#else
+static int nizifs_lz4_compress(const char *src, int len, char *dst, int max, void *wrkmem) {
+    return LZ4_compress_default(src, dst, len, max, wrkmem);   // 0 if it doesn't fit
+}
+static int nizifs_lz4_decompress(const char *src, int clen, char *dst, int max) {
+    int dlen = LZ4_decompress_safe(src, dst, clen, max);
+    return dlen < 0 ? -EIO : dlen;
+}
+#endif
+
+/* Blocks [first, first + n) of the file entry that belong to cluster c */
+static void nizifs_cluster_slots(pgoff_t c, int *first, int *n) {
+    *first = c * NIZI_FS_CLUSTER_BLOCKS;
+    *n = min_t(int, NIZI_FS_CLUSTER_BLOCKS, NIZI_FS_DATA_BLOCK_CNT - *first);
+    if (*n < 0)
+        *n = 0;
+}
+
+/*
+ * Fill the NIZI_FS_CLUSTER_SIZE bytes of @page at @offset (mapped at @dst)
+ * with cluster c. A compressed cluster is read into @bounce first
+ */
+static int nizifs_compr_read_cluster(nizifs_info_t *info, nizifs_file_entry_t *fe, int c,
+        struct page *page, unsigned offset, char *dst, struct page *bounce) {
+    int i, first, n, k, retval;
+    char *buf = page_address(bounce);
+    nizifs_cluster_header_t *hdr;
+
+    nizifs_cluster_slots(c, &first, &n);
+    if (n && (fe->perms & NIZI_FS_CLUSTER_COMPRESSED(c))) {
+        for (k = 0; k < n && fe->blocks[first + k]; k++)
+            ;
+        if ((retval = nizifs_cluster_io(info, 0, fe->blocks + first, k, bounce, 0)) < 0)
+            return retval;
+        hdr = (nizifs_cluster_header_t *)buf;
+        if (!k || hdr->clen > k * info->sb.block_size - NIZI_FS_CLUSTER_HDR)
+            return -EIO;
+        if ((retval = nizifs_lz4_decompress(buf + NIZI_FS_CLUSTER_HDR, hdr->clen, dst, NIZI_FS_CLUSTER_SIZE)) < 0)
+            return retval;
+        memset(dst + retval, 0, NIZI_FS_CLUSTER_SIZE - retval);
+        return 0;
+    }
+
+    // Raw cluster, unmapped blocks are holes
+    if ((retval = nizifs_cluster_io(info, 0, fe->blocks + first, n, page, offset)) < 0)
+        return retval;
+    for (i = 0; i < n; i++)
+        if (!fe->blocks[first + i])
+            memset(dst + i * info->sb.block_size, 0, info->sb.block_size);
+    memset(dst + n * info->sb.block_size, 0, NIZI_FS_CLUSTER_SIZE - n * info->sb.block_size);
+    return 0;
+}
+
+static int nizifs_compr_readpage(struct file *file, struct page *page) {
+    struct inode *inode = page->mapping->host;
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_file_entry_t fe;
+    struct page *bounce;
+    int j, retval;
+    char *dst;
+
+    printk(KERN_INFO "nizifs: nizifs_compr_readpage\n");
+    nizifs_lock_entry(info, inode->i_ino);
+    retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe);
+    nizifs_unlock_entry(info, inode->i_ino);
+    if (retval < 0)
+        goto out;
+    if (!(bounce = alloc_page(GFP_NOFS))) {
+        retval = -ENOMEM;
+        goto out;
+    }
+
+    dst = kmap(page);
+    for (j = 0; j < NIZI_FS_PAGE_CLUSTERS && retval >= 0; j++)
+        retval = nizifs_compr_read_cluster(info, &fe, page->index * NIZI_FS_PAGE_CLUSTERS + j,
+                page, j * NIZI_FS_CLUSTER_SIZE, dst + j * NIZI_FS_CLUSTER_SIZE, bounce);
+    kunmap(page);
+    __free_page(bounce);
+out:
+    if (retval < 0) {
+        SetPageError(page);
+    } else {
+        flush_dcache_page(page);
+        SetPageUptodate(page);
+    }
+    unlock_page(page);
+    return retval;
+}
+
+/*
+ * Claim k contiguous blocks for a cluster, taking from the space reserved by
+ * write_begin first. Its old blocks move to @old: the entry on the device
+ * still points at them, so they may only be freed once it is rewritten, see
+ * nizifs_compr_writepage(). The new blocks go to @claimed and the reservation
+ * used up to @undelayed, to undo on failure. Caller holds the entry lock
+ */
+static int nizifs_compr_alloc(struct inode *inode, nizifs_file_entry_t *fe, int first, int n, int k,
+        byte4_t *old, byte4_t *claimed, byte4_t *undelayed) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    byte4_t mask = ((1 << n) - 1) << first, delayed;
+    int i, start, goal = INV_BLOCK;
+
+    for (i = first - 1; i >= 0 && goal == INV_BLOCK; i--)
+        if (fe->blocks[i])
+            goal = fe->blocks[i] + 1;
+
+    spin_lock(&info->lock);
+    delayed = ni->delayed & mask;
+    if (info->free_blocks + hweight32(delayed) < info->reserved_blocks + k) {
+        spin_unlock(&info->lock);
+        return -ENOSPC;
+    }
+    for (i = first; i < first + n; i++) {
+        old[i] = fe->blocks[i];
+        fe->blocks[i] = 0;
+    }
+    if ((start = nizifs_claim_run(info, goal, k)) != INV_BLOCK) {
+        for (i = 0; i < k; i++)
+            fe->blocks[first + i] = start + i;
+    } else {
+        for (i = 0; i < k; i++) {
+            fe->blocks[first + i] = nizifs_claim_run(info, goal, 1);
+            goal = fe->blocks[first + i] + 1;
+        }
+    }
+    *claimed |= ((1 << k) - 1) << first;
+    // Whatever was reserved beyond k blocks is not needed anymore
+    ni->delayed &= ~delayed;
+    info->reserved_blocks -= hweight32(delayed);
+    *undelayed |= delayed;
+    spin_unlock(&info->lock);
+    return 0;
+}
+
+/*
+ * Store the @len bytes of cluster c at @offset of @page (mapped at @src),
+ * compressed into @bounce if that pays off. Caller holds the entry lock
+ */
+static int nizifs_compr_write_cluster(struct inode *inode, nizifs_file_entry_t *fe, int c,
+        struct page *page, unsigned offset, char *src, int len, struct page *bounce, char *wrkmem,
+        byte4_t *old, byte4_t *claimed, byte4_t *undelayed) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    int first, n, k, need, clen = 0, retval = 0;
+    char *buf = page_address(bounce);
+    nizifs_cluster_header_t *hdr;
+
+    nizifs_cluster_slots(c, &first, &n);
+    need = DIV_ROUND_UP(len, info->sb.block_size);
+
+    // Only worth it if at least one block is saved
+    if (need > 1 && wrkmem)
+        clen = nizifs_lz4_compress(src, len, buf + NIZI_FS_CLUSTER_HDR,
+                (need - 1) * info->sb.block_size - NIZI_FS_CLUSTER_HDR, wrkmem);
+    if (clen > 0) {
+        hdr = (nizifs_cluster_header_t *)buf;
+        hdr->clen = clen;
+        k = DIV_ROUND_UP(NIZI_FS_CLUSTER_HDR + clen, info->sb.block_size);
+        memset(buf + NIZI_FS_CLUSTER_HDR + clen, 0, k * info->sb.block_size - NIZI_FS_CLUSTER_HDR - clen);
+    } else {
+        k = need;
+    }
+
+    if ((retval = nizifs_compr_alloc(inode, fe, first, n, k, old, claimed, undelayed)) < 0)
+        return retval;
+    // Always wait for the data: the page is clean afterwards, so fsync would
+    // find nothing left to write
+    if (clen > 0)
+        retval = nizifs_cluster_io(info, 1, fe->blocks + first, k, bounce, 0);
+    else
+        retval = nizifs_cluster_io(info, 1, fe->blocks + first, k, page, offset);
+    if (retval < 0)
+        return retval;
+    if (clen > 0)
+        fe->perms |= NIZI_FS_CLUSTER_COMPRESSED(c);
+    else
+        fe->perms &= ~NIZI_FS_CLUSTER_COMPRESSED(c);
+    return 0;
+}
+
+static int nizifs_compr_writepage(struct page *page, struct writeback_control *wbc) {
+    struct inode *inode = page->mapping->host;
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    nizifs_file_entry_t fe;
+    loff_t size = i_size_read(inode), off = page_offset(page);
+    byte4_t old[NIZI_FS_DATA_BLOCK_CNT] = { 0 }, claimed = 0, undelayed = 0;
+    struct page *bounce;
+    int i, j, first, n, retval;
+    char *wrkmem, *src;
+
+    printk(KERN_INFO "nizifs: nizifs_compr_writepage\n");
+    nizifs_cluster_slots(page->index * NIZI_FS_PAGE_CLUSTERS, &first, &n);
+    if (off >= size || !n) {     // truncated meanwhile
+        unlock_page(page);
+        return 0;
+    }
+
+    if (!(bounce = alloc_page(GFP_NOFS))) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    // A raw cluster is written from the page, past EOF it must be zeroes
+    if (size < off + PAGE_SIZE)
+        zero_user_segment(page, size - off, PAGE_SIZE);
+    wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);  // stored raw without it
+    set_page_writeback(page);
+
+    nizifs_lock_entry(info, inode->i_ino);
+    if ((retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe)) < 0)
+        goto unlock;
+    if (!fe.name[0]) {  // removed while still open
+        retval = -ENOENT;
+        goto unlock;
+    }
+    src = kmap(page);
+    for (j = 0; j < NIZI_FS_PAGE_CLUSTERS && off + j * NIZI_FS_CLUSTER_SIZE < size; j++) {
+        nizifs_cluster_slots(page->index * NIZI_FS_PAGE_CLUSTERS + j, &first, &n);
+        if (!n)
+            break;
+        if ((retval = nizifs_compr_write_cluster(inode, &fe, page->index * NIZI_FS_PAGE_CLUSTERS + j,
+                page, j * NIZI_FS_CLUSTER_SIZE, src + j * NIZI_FS_CLUSTER_SIZE,
+                min_t(loff_t, NIZI_FS_CLUSTER_SIZE, size - off - j * NIZI_FS_CLUSTER_SIZE),
+                bounce, wrkmem, old, &claimed, &undelayed)) < 0)
+            break;
+    }
+    kunmap(page);
+    if (retval >= 0)
+        retval = nizifs_update_file_entry(info, inode->i_ino, &fe);
+
+    if (retval < 0) {
+        // The entry still points at the old blocks: give back the new ones, and their reservation
+        spin_lock(&info->lock);
+        for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT; i++) {
+            if (claimed & (1 << i)) {
+                info->used_blocks[fe.blocks[i]] = 0;
+                info->free_blocks++;
+            }
+        }
+        info->reserved_blocks += hweight32(undelayed);
+        ni->delayed |= undelayed;
+        spin_unlock(&info->lock);
+    } else {
+        for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT; i++)
+            if (old[i])
+                nizifs_unset_data_block(info, old[i]);
+    }
+unlock:
+    nizifs_unlock_entry(info, inode->i_ino);
+    end_page_writeback(page);
+    kfree(wrkmem);
+    __free_page(bounce);
+out:
+    if (retval < 0) {
+        SetPageError(page);
+        mapping_set_error(page->mapping, retval);
+    }
+    unlock_page(page);
+    return retval;
+}
+
+/*
+ * Reserve the blocks the clusters of page @index may need up to @end or EOF.
+ * A cluster is written to new blocks before its old ones are freed, so its
+ * mapped blocks need a reservation as well
+ */
+int nizifs_compr_reserve(struct inode *inode, pgoff_t index, loff_t end) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    nizifs_file_entry_t fe;
+    byte4_t want = 0;
+    int i, first, n, last, retval;
+
+    nizifs_cluster_slots(index * NIZI_FS_PAGE_CLUSTERS, &first, &n);
+    end = max_t(loff_t, end, min_t(loff_t, i_size_read(inode), (loff_t)(index + 1) << PAGE_SHIFT));
+    last = min_t(int, DIV_ROUND_UP(end, info->sb.block_size), NIZI_FS_DATA_BLOCK_CNT);
+    if (!n || end > ((loff_t)NIZI_FS_DATA_BLOCK_CNT << NIZI_FS_BLOCK_SIZE_BITS))
+        return -ENOSPC;
+
+    nizifs_lock_entry(info, inode->i_ino);
+    if ((retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe)) < 0)
+        goto out;
+    if (!fe.name[0]) {
+        retval = -ENOENT;
+        goto out;
+    }
+    for (i = first; i < last; i++)
+        want |= 1 << i;
+
+    spin_lock(&info->lock);
+    want &= ~ni->delayed;
+    if (info->free_blocks < info->reserved_blocks + hweight32(want)) {
+        retval = -ENOSPC;
+    } else {
+        info->reserved_blocks += hweight32(want);
+        ni->delayed |= want;
+    }
+    spin_unlock(&info->lock);
+out:
+    nizifs_unlock_entry(info, inode->i_ino);
+    return retval;
+}
+
+static int nizifs_compr_write_begin(struct file *file, struct address_space *mapping,
+        loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata) {
+    struct inode *inode = mapping->host;
+    pgoff_t index = pos >> PAGE_SHIFT;
+    struct page *page;
+    int retval;
+
+    printk(KERN_INFO "nizifs: nizifs_compr_write_begin\n");
+    if ((retval = nizifs_compr_reserve(inode, index, pos + len)) < 0)
+        return retval;
+    if (!(page = grab_cache_page_write_begin(mapping, index, flags)))
+        return -ENOMEM;
+    *pagep = page;
+
+    // A partial write needs the rest of the cluster, decompressed
+    if (!PageUptodate(page) && len != PAGE_SIZE) {
+        if ((retval = nizifs_compr_readpage(file, page)) < 0)
+            goto fail;
+        lock_page(page);
+        if (!PageUptodate(page)) {
+            retval = -EIO;
+            unlock_page(page);
+            goto fail;
+        }
+    }
+    return 0;
+fail:
+    nizifs_put_page(page);
+    *pagep = NULL;
+    return retval;
+}
+
+static int nizifs_compr_write_end(struct file *file, struct address_space *mapping,
+        loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata) {
+    struct inode *inode = mapping->host;
+    loff_t old_size = i_size_read(inode);
+    int retval;
+
+    retval = simple_write_end(file, mapping, pos, len, copied, page, fsdata);
+    if (i_size_read(inode) != old_size)
+        mark_inode_dirty(inode);
+    return retval;
+}
+
+const struct address_space_operations nizifs_compr_aops = {
+    readpage: nizifs_compr_readpage,
+    writepage: nizifs_compr_writepage,
+    write_begin: nizifs_compr_write_begin,
+    write_end: nizifs_compr_write_end,
+    set_page_dirty: __set_page_dirty_nobuffers
+};
@@ -1,6 +1,12 @@
 #include <linux/version.h>
 #include <linux/buffer_head.h>  /* map_bh, block_write_begin, block_write_full_page, generic_write_end */
 #include <linux/mpage.h> /* mpage_readpage, ... */
+#include <linux/bitops.h> /* hweight32 */
+#include <linux/blkdev.h> /* sb_issue_zeroout */
+#include <linux/falloc.h> /* FALLOC_FL_KEEP_SIZE */
+#include <linux/uaccess.h> /* copy_from_user, copy_to_user */
+#include <linux/mm.h> /* vm_operations_struct, ... */
+#include <linux/highmem.h> /* zero_user */
 #include "nizifs.h"
 #include "real_io.h"
 
@@ -35,19 +41,22 @@ static int nizifs_readdir(struct file *file, void *dirent, filldir_t filldir) {
     loff_t pos = 1;
     nizifs_file_entry_t fe;
     nizifs_info_t *info = de->d_inode->i_sb->s_fs_info;
+    retval = 0;
+    down_read(&info->dir_sem);
     for (int ino = 0; ino < info->sb.entry_count; ino++) {
         if ((retval = read_entry_from_nizifs(info, ino, &fe)) < 0)
-            return retval;
+            break;
         if (!fe.name[0]) continue;
         pos++;
         if (file->f_pos == pos) {
             retval = filldir(dirent, fe.name, strlen(fe.name), file->f_pos, N2V_INODE_NUM(ino), DT_REG);
             if (retval)
-                return retval;
+                break;
             file->f_pos++;
         }
     }
-    return 0;
+    up_read(&info->dir_sem);
+    return retval;
 }
 #else
 static int nizifs_iterate(struct file *file, struct dir_context *ctx) {
@@ -61,91 +70,915 @@ static int nizifs_iterate(struct file *file, struct dir_context *ctx) {
     if (!dir_emit_dots(file, ctx))
         return -ENOSPC;
 
+    retval = 0;
+    down_read(&info->dir_sem);
     for (ino = 0; ino < info->sb.entry_count; ino++) {
         if ((retval = read_entry_from_nizifs(info, ino, &fe)) < 0)
-            return retval;
+            break;
         if (!fe.name[0]) continue;
         pos++;
         if (ctx->pos == pos) {
-            if (!dir_emit(ctx, fe.name, strlen(fe.name), N2V_INODE_NUM(ino), DT_REG))
-                return -ENOSPC;
+            if (!dir_emit(ctx, fe.name, strlen(fe.name), N2V_INODE_NUM(ino), DT_REG)) {
+                retval = -ENOSPC;
+                break;
+            }
             ctx->pos++;
         }
     }
-    return 0;
+    up_read(&info->dir_sem);
+    return retval;
 }
 #endif
 
-/* Return a unused data block index */
-static int nizifs_get_data_block(nizifs_info_t *info) {
-    int i;
+/* Find @count contiguous unused blocks within [from, to). Caller holds info->lock */
+static int nizifs_find_run(nizifs_info_t *info, int from, int to, int count) {
+    int i, run = 0;
+    for (i = from; i < to; i++) {
+        run = info->used_blocks[i] ? 0 : run + 1;
+        if (run == count)
+            return i - count + 1;
+    }
+    return INV_BLOCK;
+}
+
+/*
+ * Mark @count contiguous unused data blocks as used, preferably starting at @goal
+ * so that a file keeps growing in place. Caller holds info->lock
+ */
+int nizifs_claim_run(nizifs_info_t *info, int goal, int count) {
+    int start, i;
+
+    if (goal < info->sb.data_block_start || goal >= info->sb.partition_size)
+        goal = info->sb.data_block_start;
+    if ((start = nizifs_find_run(info, goal, info->sb.partition_size, count)) == INV_BLOCK &&
+            (start = nizifs_find_run(info, info->sb.data_block_start, info->sb.partition_size, count)) == INV_BLOCK)
+        return INV_BLOCK;
+
+    for (i = start; i < start + count; i++)
+        info->used_blocks[i] = 1;
+    info->free_blocks -= count;
+    return start;
+}
+
+/*
+ * Return a unused data block index
+ * If @reserved the space was already reserved by a delayed write, otherwise
+ * blocks promised to delayed writes can't be handed out
+ */
+static int nizifs_get_data_block(nizifs_info_t *info, int goal, int reserved) {
+    int block = INV_BLOCK;
+    spin_lock(&info->lock);
+    if (reserved || info->free_blocks > info->reserved_blocks) {
+        block = nizifs_claim_run(info, goal, 1);
+        if (block != INV_BLOCK && reserved)
+            info->reserved_blocks--;
+    }
+    spin_unlock(&info->lock);
+    return block;
+}
+
+/* Caller holds info->lock */
+static int nizifs_trimmable(nizifs_info_t *info, int i, int pending_only) {
+    if (info->used_blocks[i])
+        return 0;
+    return !pending_only || info->discard_pending[i];
+}
+
+/*
+ * Discard the free blocks within [from, to) in runs of at least @minlen blocks,
+ * or only those freed since the last pass if @pending_only. Each run is marked
+ * used while its discard is in flight, so the allocator can't hand it out
+ * meanwhile; blocks promised to delayed writes are never held back
+ */
+static int nizifs_trim(nizifs_info_t *info, int from, int to, int minlen, int pending_only, byte8_t *trimmed) {
+    int i, start, count, room, retval = 0;
+
+    *trimmed = 0;
     spin_lock(&info->lock);
-    for (i = info->sb.data_block_start; i < info->sb.partition_size; i++) {
-        if (info->used_blocks[i] == 0) {
-            info->used_blocks[i] = 1;
-            spin_unlock(&info->lock);
-            return i;
+    for (i = from; i < to; ) {
+        if (!nizifs_trimmable(info, i, pending_only)) {
+            if (pending_only)
+                info->discard_pending[i] = 0;   // reallocated meanwhile, nothing to discard
+            i++;
+            continue;
+        }
+        room = min_t(int, NIZI_FS_TRIM_CHUNK, info->free_blocks - info->reserved_blocks);
+        if (room < minlen)
+            break;
+        for (start = i; i < to && i - start < room && nizifs_trimmable(info, i, pending_only); i++) {
+            if (pending_only)
+                info->discard_pending[i] = 0;
         }
+        count = i - start;
+        if (count < minlen)
+            continue;
+
+        memset(info->used_blocks + start, 1, count);
+        info->free_blocks -= count;
+        spin_unlock(&info->lock);
+
+        retval = sb_issue_discard(info->vfs_sb, start, count, GFP_NOFS, 0);
+        cond_resched();
+
+        spin_lock(&info->lock);
+        memset(info->used_blocks + start, 0, count);
+        info->free_blocks += count;
+        if (retval < 0)
+            break;
+        *trimmed += count;
     }
     spin_unlock(&info->lock);
-    return INV_BLOCK;
+    return retval;
+}
+
+/* Online discard (mount -o discard): freed blocks are discarded in batches */
+void nizifs_discard_work(struct work_struct *work) {
+    nizifs_info_t *info = container_of(to_delayed_work(work), nizifs_info_t, discard_work);
+    byte8_t trimmed;
+    int retval;
+
+    retval = nizifs_trim(info, info->sb.data_block_start, info->sb.partition_size, 1, 1, &trimmed);
+    printk(KERN_INFO "nizifs: nizifs_discard_work discarded %llu blocks (%d)\n", trimmed, retval);
+}
+
+/* Give back the space reserved by the delayed blocks of this inode */
+void nizifs_release_delayed(struct inode *inode) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+
+    spin_lock(&info->lock);
+    info->reserved_blocks -= hweight32(ni->delayed);
+    ni->delayed = 0;
+    spin_unlock(&info->lock);
+}
+
+/*
+ * Zero the rest of the block holding the new EOF of a shrinking file, so the
+ * old data doesn't come back when it grows again. Goes through write_begin,
+ * which reserves the space and copies a block shared with a clone. For a
+ * compressed file it is the rest of the cluster, even from a block boundary:
+ * the cluster is dirtied so that writeback stores it again without the LZ4
+ * bytes past the new EOF
+ */
+static int nizifs_zero_tail(struct inode *inode, loff_t size) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    nizifs_file_entry_t fe;
+    struct page *page;
+    void *fsdata;
+    int i = size >> NIZI_FS_BLOCK_SIZE_BITS, retval;
+    loff_t end;
+    unsigned len;
+
+    if (size >= i_size_read(inode))
+        return 0;
+    if (ni->flags & NIZI_FS_FLAG_COMPRESSED) {
+        if (!(size & (NIZI_FS_CLUSTER_SIZE - 1)))
+            return 0;
+        end = round_up(size, NIZI_FS_CLUSTER_SIZE);
+    } else {
+        if (!(size & (NIZI_FS_BLOCK_SIZE - 1)))
+            return 0;
+        // Nothing to zero in a hole
+        nizifs_lock_entry(info, inode->i_ino);
+        retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe);
+        nizifs_unlock_entry(info, inode->i_ino);
+        if (retval < 0)
+            return retval;
+        if (!fe.blocks[i] && !(ni->delayed & (1 << i)))
+            return 0;
+        end = round_up(size, NIZI_FS_BLOCK_SIZE);
+    }
+    // Past the old EOF there is nothing on the device, and write_end would grow the file
+    len = min_t(loff_t, end, i_size_read(inode)) - size;
+
+    if ((retval = pagecache_write_begin(NULL, inode->i_mapping, size, len, 0, &page, &fsdata)) < 0)
+        return retval;
+    zero_user(page, offset_in_page(size), len);
+    retval = pagecache_write_end(NULL, inode->i_mapping, size, len, len, page, fsdata);
+    return retval < 0 ? retval : 0;
+}
+
+/*
+ * Change the size of a file to @size: drop its pages past the new EOF, give
+ * back the space reserved for their delayed blocks and free the blocks past
+ * it. Only blocks preallocated by fallocate(FALLOC_FL_KEEP_SIZE) are kept past
+ * the old EOF of a growing file, anything else there is left over data. A
+ * compressed cluster still partly below EOF keeps its blocks, they hold a
+ * single LZ4 stream. Caller holds the inode lock
+ */
+int nizifs_truncate(struct inode *inode, loff_t size) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    nizifs_file_entry_t fe;
+    loff_t end = min_t(loff_t, size, i_size_read(inode));
+    byte4_t drop, keep, freed[NIZI_FS_DATA_BLOCK_CNT] = { 0 };
+    int i, c, first = DIV_ROUND_UP(end, NIZI_FS_BLOCK_SIZE), retval;
+
+    printk(KERN_INFO "nizifs: nizifs_truncate (i_no = %ld) to %lld\n", inode->i_ino, size);
+    keep = size > end ? ni->prealloc : 0;
+    if ((retval = nizifs_zero_tail(inode, size)) < 0)
+        return retval;
+    truncate_setsize(inode, size);
+    ni->prealloc &= keep | ((1 << first) - 1);
+
+    nizifs_lock_entry(info, inode->i_ino);
+    spin_lock(&info->lock);
+    drop = ni->delayed & ~((1 << first) - 1);
+    ni->delayed &= ~drop;
+    info->reserved_blocks -= hweight32(drop);
+    spin_unlock(&info->lock);
+
+    if ((retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe)) < 0 || !fe.name[0])
+        goto out;
+    for (i = first; i < NIZI_FS_DATA_BLOCK_CNT; i++) {
+        c = i / NIZI_FS_CLUSTER_BLOCKS;
+        if ((keep & (1 << i)) ||
+                ((fe.perms & NIZI_FS_CLUSTER_COMPRESSED(c)) && c * NIZI_FS_CLUSTER_BLOCKS * NIZI_FS_BLOCK_SIZE < end))
+            continue;
+        fe.perms &= ~NIZI_FS_CLUSTER_COMPRESSED(c);
+        freed[i] = fe.blocks[i];
+        fe.blocks[i] = 0;
+    }
+    fe.size = size;
+    // Only free them once no entry on the device points at them anymore
+    if ((retval = nizifs_update_file_entry(info, inode->i_ino, &fe)) < 0)
+        goto out;
+    for (i = first; i < NIZI_FS_DATA_BLOCK_CNT; i++)
+        if (freed[i])
+            nizifs_unset_data_block(info, freed[i]);
+out:
+    nizifs_unlock_entry(info, inode->i_ino);
+    return retval;
 }
 
 // TODO: Need to understand this and how it works with address_space_operations
-static int nizifs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+static int __nizifs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
     struct super_block *sb = inode->i_sb;
     nizifs_info_t *info = (nizifs_info_t *)(sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
     nizifs_file_entry_t fe;
     sector_t phys;      // indexing onto the disc partition, i.e. our data block index
-    int retval;
+    int retval, reserved, goal, old;
 
     printk(KERN_INFO "nizifs: nizifs_get_block called for I: %ld, B: %llu, C: %d\n",
             inode->i_ino, (unsigned long long)(iblock), create);
     if (iblock >= NIZI_FS_DATA_BLOCK_CNT)
-        return -ENOSPC;
+        return create ? -ENOSPC : 0;
     if ((retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe)) < 0)
         return retval;
-    if (!fe.blocks[iblock]) {
-        if (!create) {
-            return -EIO;
-        } else {
-            if ((fe.blocks[iblock] = nizifs_get_data_block(info)) == INV_BLOCK)
-                return -ENOSPC;
-            if ((retval = nizifs_update_file_entry(info, inode->i_ino, &fe)) < 0)
-                return retval;
+    if (!fe.name[0])    // removed while still open
+        return -ENOENT;
+    if (!create) {
+        if (fe.blocks[iblock])
+            map_bh(bh_result, sb, fe.blocks[iblock]);
+        return 0;   // a hole, left unmapped the buffer is zero filled without device I/O
+    }
+
+    // A delayed block not allocated by nizifs_writepages, its space is already reserved.
+    // If it is mapped nevertheless, it is shared with a clone and gets copied on write
+    spin_lock(&info->lock);
+    reserved = ni->delayed & (1 << iblock);
+    ni->delayed &= ~(1 << iblock);
+    spin_unlock(&info->lock);
+    if (fe.blocks[iblock] && !reserved) {
+        map_bh(bh_result, sb, fe.blocks[iblock]);
+        return 0;
+    }
+
+    old = fe.blocks[iblock];
+    goal = old ? old : ((iblock > 0 && fe.blocks[iblock-1]) ? fe.blocks[iblock-1] + 1 : INV_BLOCK);
+    if ((fe.blocks[iblock] = nizifs_get_data_block(info, goal, reserved)) == INV_BLOCK) {
+        if (reserved) {
+            spin_lock(&info->lock);
+            ni->delayed |= reserved;
+            spin_unlock(&info->lock);
         }
+        return -ENOSPC;
     }
+    if ((retval = nizifs_update_file_entry(info, inode->i_ino, &fe)) < 0)
+        return retval;
+    if (old)
+        nizifs_unset_data_block(info, old);
 
     phys = fe.blocks[iblock];
     map_bh(bh_result, sb, phys);    // TODO: Understand this
     return 0;
 }
 
+static int nizifs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    int retval;
+    nizifs_lock_entry(info, inode->i_ino);
+    retval = __nizifs_get_block(inode, iblock, bh_result, create);
+    nizifs_unlock_entry(info, inode->i_ino);
+    return retval;
+}
+
+/*
+ * get_block used by write_begin: nothing is allocated at write time, the space
+ * is only reserved and the buffer mapped to a placeholder. The real block is
+ * chosen at writeback, see nizifs_alloc_delayed()
+ */
+static int __nizifs_get_block_prep(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    struct super_block *sb = inode->i_sb;
+    nizifs_info_t *info = (nizifs_info_t *)(sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    nizifs_file_entry_t fe;
+    int retval;
+
+    if (iblock >= NIZI_FS_DATA_BLOCK_CNT)
+        return -ENOSPC;
+    if ((retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe)) < 0)
+        return retval;
+    if (!fe.name[0])
+        return -ENOENT;
+    if (fe.blocks[iblock]) {
+        map_bh(bh_result, sb, fe.blocks[iblock]);
+        return 0;
+    }
+
+    spin_lock(&info->lock);
+    if (!(ni->delayed & (1 << iblock))) {
+        if (info->free_blocks <= info->reserved_blocks) {
+            spin_unlock(&info->lock);
+            return -ENOSPC;
+        }
+        info->reserved_blocks++;
+        ni->delayed |= 1 << iblock;
+    }
+    spin_unlock(&info->lock);
+
+    map_bh(bh_result, sb, DELAYED_BLOCK);
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
+    return 0;
+}
+
+static int nizifs_get_block_prep(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    int retval;
+    nizifs_lock_entry(info, inode->i_ino);
+    retval = __nizifs_get_block_prep(inode, iblock, bh_result, create);
+    nizifs_unlock_entry(info, inode->i_ino);
+    return retval;
+}
+
+/*
+ * Allocate all delayed blocks of a file as one contiguous run, right after
+ * the blocks it already has if possible. If no such run is left, they are
+ * allocated one by one by nizifs_get_block() as the pages are written
+ */
+static int nizifs_alloc_delayed(struct inode *inode) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    nizifs_file_entry_t fe;
+    byte4_t delayed, shared[NIZI_FS_DATA_BLOCK_CNT];
+    int i, n, start, retval, goal = INV_BLOCK;
+
+    spin_lock(&info->lock);
+    delayed = ni->delayed;
+    spin_unlock(&info->lock);
+    if (!delayed)
+        return 0;
+
+    nizifs_lock_entry(info, inode->i_ino);
+    if ((retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe)) < 0 || !fe.name[0])
+        goto out;
+    for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT && !(delayed & (1 << i)); i++)
+        if (fe.blocks[i])
+            goal = fe.blocks[i] + 1;
+
+    spin_lock(&info->lock);
+    delayed &= ni->delayed;     // some may have been allocated by a single writepage meanwhile
+    n = hweight32(delayed);
+    if (!n || (start = nizifs_claim_run(info, goal, n)) == INV_BLOCK) {
+        spin_unlock(&info->lock);
+        goto out;
+    }
+    ni->delayed &= ~delayed;
+    info->reserved_blocks -= n;
+    spin_unlock(&info->lock);
+
+    // Blocks shared with a clone are delayed too, they are replaced by a private copy
+    for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT; i++) {
+        if (delayed & (1 << i)) {
+            shared[i] = fe.blocks[i];
+            fe.blocks[i] = start + hweight32(delayed & ((1 << i) - 1));
+        }
+    }
+
+    if ((retval = nizifs_update_file_entry(info, inode->i_ino, &fe)) < 0) {
+        // Undo, the blocks stay reserved for the pages
+        spin_lock(&info->lock);
+        for (i = start; i < start + n; i++)
+            info->used_blocks[i] = 0;
+        info->free_blocks += n;
+        info->reserved_blocks += n;
+        ni->delayed |= delayed;
+        spin_unlock(&info->lock);
+        goto out;
+    }
+    for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT; i++)
+        if ((delayed & (1 << i)) && shared[i])
+            nizifs_unset_data_block(info, shared[i]);
+out:
+    nizifs_unlock_entry(info, inode->i_ino);
+    return retval;
+}
+
+/*
+ * SEEK_DATA/SEEK_HOLE on top of generic_file_llseek. A block is data once it
+ * is allocated (preallocated ones included) or delayed, anything else below
+ * EOF is a hole
+ */
+static loff_t nizifs_file_llseek(struct file *file, loff_t offset, int whence) {
+    struct inode *inode = file_inode(file);
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_file_entry_t fe;
+    byte4_t data = 0;
+    loff_t size, pos;
+    int i, hole, retval;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return generic_file_llseek(file, offset, whence);
+
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0))
+    mutex_lock(&inode->i_mutex);
+    #else
+    inode_lock(inode);
+    #endif
+
+    size = i_size_read(inode);
+    if (offset < 0 || offset >= size) {
+        pos = -ENXIO;
+        goto out;
+    }
+
+    nizifs_lock_entry(info, inode->i_ino);
+    retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe);
+    nizifs_unlock_entry(info, inode->i_ino);
+    if (retval < 0) {
+        pos = retval;
+        goto out;
+    }
+    spin_lock(&info->lock);
+    data = NIZIFS_I(inode)->delayed;
+    spin_unlock(&info->lock);
+    for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT; i++)
+        if (fe.blocks[i])
+            data |= 1 << i;
+    // A compressed cluster only fills its first blocks, its data spans all of them though
+    for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT; i += NIZI_FS_CLUSTER_BLOCKS)
+        if ((fe.perms & NIZI_FS_CLUSTER_COMPRESSED(i / NIZI_FS_CLUSTER_BLOCKS)) && fe.blocks[i])
+            data |= ((1 << NIZI_FS_CLUSTER_BLOCKS) - 1) << i;
+
+    // EOF counts as a hole, no data past it
+    pos = whence == SEEK_HOLE ? size : -ENXIO;
+    for (i = offset >> NIZI_FS_BLOCK_SIZE_BITS; ((loff_t)i << NIZI_FS_BLOCK_SIZE_BITS) < size; i++) {
+        hole = i >= NIZI_FS_DATA_BLOCK_CNT || !(data & (1 << i));  // nothing is mapped past the last entry block
+        if (hole == (whence == SEEK_HOLE)) {
+            pos = max_t(loff_t, offset, (loff_t)i << NIZI_FS_BLOCK_SIZE_BITS);
+            break;
+        }
+    }
+    if (pos >= 0) {
+        #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
+        if (pos != file->f_pos) {
+            file->f_pos = pos;
+            file->f_version = 0;
+        }
+        #else
+        pos = vfs_setpos(file, pos, inode->i_sb->s_maxbytes);
+        #endif
+    }
+out:
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0))
+    mutex_unlock(&inode->i_mutex);
+    #else
+    inode_unlock(inode);
+    #endif
+    return pos;
+}
+
+/*
+ * Preallocate the blocks of [offset, offset+len), as one contiguous run when
+ * the free space allows it. Our file entry has no room for an unwritten flag,
+ * so the new blocks are zeroed on the device instead; on a loop device this
+ * becomes a cheap zero range of the backing file
+ */
+static long nizifs_fallocate(struct file *file, int mode, loff_t offset, loff_t len) {
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    nizifs_info_t *info = (nizifs_info_t *)(sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    nizifs_file_entry_t fe;
+    byte4_t want = 0, delayed = 0;
+    int i, j, n, first, last, start, goal = INV_BLOCK;
+    long retval;
+
+    printk(KERN_INFO "nizifs: nizifs_fallocate (i_no = %ld), %lld + %lld\n", inode->i_ino, offset, len);
+    if ((mode & ~FALLOC_FL_KEEP_SIZE) || (ni->flags & NIZI_FS_FLAG_COMPRESSED))
+        return -EOPNOTSUPP;
+    if (offset + len > ((loff_t)NIZI_FS_DATA_BLOCK_CNT << NIZI_FS_BLOCK_SIZE_BITS))
+        return -EFBIG;
+    first = offset >> NIZI_FS_BLOCK_SIZE_BITS;
+    last = (offset + len - 1) >> NIZI_FS_BLOCK_SIZE_BITS;
+
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0))
+    mutex_lock(&inode->i_mutex);
+    #else
+    inode_lock(inode);
+    #endif
+    nizifs_lock_entry(info, inode->i_ino);
+
+    if ((retval = read_entry_with_vfs_ino(info, inode->i_ino, &fe)) < 0)
+        goto out;
+    if (!fe.name[0]) {
+        retval = -ENOENT;
+        goto out;
+    }
+    for (i = first; i <= last; i++)
+        if (!fe.blocks[i])
+            want |= 1 << i;
+    for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT && !(want & (1 << i)); i++)
+        if (fe.blocks[i])
+            goal = fe.blocks[i] + 1;
+    if (!(n = hweight32(want)))
+        goto set_size;
+
+    // Delayed blocks in the range already hold a reservation, allocate them now as well
+    spin_lock(&info->lock);
+    delayed = want & ni->delayed;
+    if (info->free_blocks + hweight32(delayed) < info->reserved_blocks + n) {
+        spin_unlock(&info->lock);
+        retval = -ENOSPC;
+        goto out;
+    }
+    if ((start = nizifs_claim_run(info, goal, n)) != INV_BLOCK) {
+        for (i = first; i <= last; i++)
+            if (want & (1 << i))
+                fe.blocks[i] = start++;
+    } else {
+        // No single run left, enough free blocks though
+        for (i = first; i <= last; i++) {
+            if (!(want & (1 << i)))
+                continue;
+            fe.blocks[i] = nizifs_claim_run(info, goal, 1);
+            goal = fe.blocks[i] + 1;
+        }
+    }
+    ni->delayed &= ~delayed;
+    info->reserved_blocks -= hweight32(delayed);
+    spin_unlock(&info->lock);
+    if (mode & FALLOC_FL_KEEP_SIZE)
+        for (i = first; i <= last; i++)
+            if ((want & (1 << i)) && ((loff_t)i << NIZI_FS_BLOCK_SIZE_BITS) >= i_size_read(inode))
+                ni->prealloc |= 1 << i;
+
+    // Zero the new blocks, one request per physically contiguous piece
+    for (i = first; i <= last; i = j) {
+        j = i + 1;
+        if (!(want & (1 << i)))
+            continue;
+        while (j <= last && (want & (1 << j)) && fe.blocks[j] == fe.blocks[j-1] + 1)
+            j++;
+        if ((retval = sb_issue_zeroout(sb, fe.blocks[i], j - i, GFP_NOFS)) < 0)
+            break;
+    }
+    if (retval < 0 || (retval = nizifs_update_file_entry(info, inode->i_ino, &fe)) < 0) {
+        spin_lock(&info->lock);
+        for (i = first; i <= last; i++)
+            if (want & (1 << i))
+                info->used_blocks[fe.blocks[i]] = 0;
+        info->free_blocks += n;
+        info->reserved_blocks += hweight32(delayed);
+        ni->delayed |= delayed;
+        spin_unlock(&info->lock);
+        ni->prealloc &= ~want;
+        goto out;
+    }
+
+set_size:
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > i_size_read(inode)) {
+        i_size_write(inode, offset + len);
+        mark_inode_dirty(inode);
+    }
+out:
+    nizifs_unlock_entry(info, inode->i_ino);
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0))
+    mutex_unlock(&inode->i_mutex);
+    #else
+    inode_unlock(inode);
+    #endif
+    return retval;
+}
+
+/* FITRIM, i.e. fstrim(8): discard the free space of the given byte range */
+static int nizifs_ioctl_fitrim(nizifs_info_t *info, struct fstrim_range __user *arg) {
+    struct fstrim_range range;
+    byte8_t from, to, end, trimmed;
+    int retval;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (!blk_queue_discard(bdev_get_queue(info->vfs_sb->s_bdev)))
+        return -EOPNOTSUPP;
+    if (copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+
+    end = range.len > ULLONG_MAX - range.start ? ULLONG_MAX : range.start + range.len;
+    from = max_t(byte8_t, range.start >> NIZI_FS_BLOCK_SIZE_BITS, info->sb.data_block_start);
+    to = min_t(byte8_t, end >> NIZI_FS_BLOCK_SIZE_BITS, info->sb.partition_size);
+    range.minlen = max_t(byte8_t, range.minlen >> NIZI_FS_BLOCK_SIZE_BITS, 1);
+    if (range.minlen > info->sb.partition_size - info->sb.data_block_start)
+        return -EINVAL;
+
+    trimmed = 0;
+    if (from < to &&
+            (retval = nizifs_trim(info, from, to, range.minlen, 0, &trimmed)) < 0)
+        return retval;
+
+    range.len = trimmed << NIZI_FS_BLOCK_SIZE_BITS;
+    if (copy_to_user(arg, &range, sizeof(range)))
+        return -EFAULT;
+    return 0;
+}
+
+static long nizifs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    nizifs_info_t *info = (nizifs_info_t *)(file_inode(file)->i_sb->s_fs_info);
 
+    printk(KERN_INFO "nizifs: nizifs_ioctl: %x\n", cmd);
+    switch (cmd) {
+    case FITRIM:
+        return nizifs_ioctl_fitrim(info, (struct fstrim_range __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
 
 static int nizifs_readpage(struct file *file, struct page *page) {
     printk(KERN_INFO "nizifs: nizifs_readpage\n");
     return mpage_readpage(page, nizifs_get_block);
 }
+static int nizifs_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages) {
+    printk(KERN_INFO "nizifs: nizifs_readpages\n");
+    return mpage_readpages(mapping, pages, nr_pages, nizifs_get_block);   // contiguous blocks go out as one bio
+}
 static int nizifs_writepage(struct page *page, struct writeback_control *wbc) {
     printk(KERN_INFO "nizifs: nizifs_writepage\n");
     return block_write_full_page(page, nizifs_get_block, wbc);
 }
+static int nizifs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
+    int retval;
+    printk(KERN_INFO "nizifs: nizifs_writepages\n");
+    if ((retval = nizifs_alloc_delayed(mapping->host)) < 0)
+        return retval;
+    return generic_writepages(mapping, wbc);    // each page goes through nizifs_writepage
+}
+/*
+ * Blocks shared with a clone must not be written in place. Buffers in
+ * [from, to) mapped onto one are marked delayed, with space reserved, so
+ * writeback moves them to a private block, see nizifs_get_block()
+ */
+static int nizifs_prepare_cow(struct inode *inode, struct page *page, unsigned from, unsigned to) {
+    nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(inode);
+    struct buffer_head *head, *bh;
+    unsigned block_start, block_end;
+    sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - NIZI_FS_BLOCK_SIZE_BITS);
+    int retval = 0;
+
+    if (!page_has_buffers(page))
+        return 0;
+    head = page_buffers(page);
+
+    nizifs_lock_entry(info, inode->i_ino);
+    spin_lock(&info->lock);
+    for (bh = head, block_start = 0; bh != head || !block_start;
+            block_start = block_end, bh = bh->b_this_page, iblock++) {
+        block_end = block_start + bh->b_size;
+        if (block_end <= from || block_start >= to)
+            continue;
+        if (!buffer_mapped(bh) || buffer_delay(bh) || info->used_blocks[bh->b_blocknr] < 2)
+            continue;
+        if (!(ni->delayed & (1 << iblock))) {
+            if (info->free_blocks <= info->reserved_blocks) {
+                retval = -ENOSPC;
+                break;
+            }
+            info->reserved_blocks++;
+            ni->delayed |= 1 << iblock;
+        }
+        set_buffer_delay(bh);
+    }
+    spin_unlock(&info->lock);
+    nizifs_unlock_entry(info, inode->i_ino);
+    return retval;
+}
+
 static int nizifs_write_begin(struct file *file, struct address_space *mapping,
-        loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdaata) {
+        loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata) {
+    unsigned from = pos & (PAGE_SIZE - 1);
+    int retval;
+
     printk(KERN_INFO "nizifs: nizifs_write_begin\n");
     *pagep = NULL;
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36))
-    return block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, nizifs_get_block);
+    retval = block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, nizifs_get_block_prep);
 #else
-    return block_write_begin(mapping, pos, len, flags, pagep, nizifs_get_block);
+    retval = block_write_begin(mapping, pos, len, flags, pagep, nizifs_get_block_prep);
 #endif
+    if (retval < 0)
+        return retval;
+    if ((retval = nizifs_prepare_cow(mapping->host, *pagep, from, from + len)) < 0) {
+        unlock_page(*pagep);
+        nizifs_put_page(*pagep);
+        *pagep = NULL;
+    }
+    return retval;
+}
+
+static int nizifs_mkwrite_return(int err) {
+    if (!err)
+        return VM_FAULT_LOCKED;
+    if (err == -EFAULT || err == -EAGAIN)
+        return VM_FAULT_NOPAGE;
+    if (err == -ENOMEM)
+        return VM_FAULT_OOM;
+    return VM_FAULT_SIGBUS;     // ENOSPC included, the writer learns it now rather than at writeback
+}
+
+/*
+ * A shared mapping is about to dirty a page: reserve its blocks the way
+ * write_begin does, so the data always has a place to go at writeback
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0))
+static int nizifs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf) {
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0))
+static int nizifs_page_mkwrite(struct vm_fault *vmf) {
+    struct vm_area_struct *vma = vmf->vma;
+#else
+static vm_fault_t nizifs_page_mkwrite(struct vm_fault *vmf) {
+    struct vm_area_struct *vma = vmf->vma;
+#endif
+    struct page *page = vmf->page;
+    struct inode *inode = file_inode(vma->vm_file);
+    loff_t size;
+    int retval;
+
+    printk(KERN_INFO "nizifs: nizifs_page_mkwrite (i_no = %ld), page %lu\n", inode->i_ino, page->index);
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vma->vm_file);
+
+    if (NIZIFS_I(inode)->flags & NIZI_FS_FLAG_COMPRESSED) {
+        // No buffers, the whole cluster is written at once
+        lock_page(page);
+        size = i_size_read(inode);
+        if (page->mapping != inode->i_mapping || page_offset(page) >= size) {
+            unlock_page(page);
+            retval = -EFAULT;   // truncated meanwhile
+        } else if ((retval = nizifs_compr_reserve(inode, page->index,
+                min_t(loff_t, size, page_offset(page) + PAGE_SIZE))) < 0) {
+            unlock_page(page);
+        } else {
+            set_page_dirty(page);
+            wait_for_stable_page(page);
+        }
+    } else {
+        // Maps the page's blocks with nizifs_get_block_prep, and returns with the page locked
+        if (!(retval = block_page_mkwrite(vma, vmf, nizifs_get_block_prep)) &&
+                (retval = nizifs_prepare_cow(inode, page, 0, PAGE_SIZE)) < 0)
+            unlock_page(page);
+    }
+
+    sb_end_pagefault(inode->i_sb);
+    return nizifs_mkwrite_return(retval);
+}
+
+static const struct vm_operations_struct nizifs_file_vm_ops = {
+    fault: filemap_fault,
+    #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0))
+    map_pages: filemap_map_pages,
+    #endif
+    page_mkwrite: nizifs_page_mkwrite
+};
+
+static int nizifs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+    printk(KERN_INFO "nizifs: nizifs_file_mmap\n");
+    file_accessed(file);
+    vma->vm_ops = &nizifs_file_vm_ops;
+    return 0;
 }
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0))
+/*
+ * Clone (FICLONE, FICLONERANGE) by sharing the data blocks, only the entry of
+ * the destination is written. Each block counts its users in used_blocks, and
+ * the write path copies shared blocks on write
+ */
+static loff_t nizifs_remap_file_range(struct file *file_in, loff_t pos_in,
+        struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags) {
+    struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+    nizifs_info_t *info = (nizifs_info_t *)(dst->i_sb->s_fs_info);
+    nizifs_inode_info_t *ni = NIZIFS_I(dst);
+    nizifs_file_entry_t fe_src, fe_dst_buf, *fe_dst;
+    byte4_t unreserve = 0;
+    int i, s, d, count, blk;
+    loff_t retval;
+
+    printk(KERN_INFO "nizifs: nizifs_remap_file_range (%ld -> %ld)\n", src->i_ino, dst->i_ino);
+    if (remap_flags & ~REMAP_FILE_CAN_SHORTEN)  // no dedupe
+        return -EOPNOTSUPP;
+    if ((NIZIFS_I(src)->flags | ni->flags) & NIZI_FS_FLAG_COMPRESSED)
+        return -EOPNOTSUPP;
+
+    lock_two_nondirectories(src, dst);
+    // Checks alignment, sizes, and writes back both ranges
+    if ((retval = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags)) < 0 || !len)
+        goto out;
+    if (pos_out + len > ((loff_t)NIZI_FS_DATA_BLOCK_CNT << NIZI_FS_BLOCK_SIZE_BITS)) {
+        retval = -EFBIG;
+        goto out;
+    }
+    // Cached pages of both ranges may map blocks that are going to be shared or dropped
+    truncate_inode_pages_range(&dst->i_data, pos_out, round_up(pos_out + len, PAGE_SIZE) - 1);
+    invalidate_inode_pages2_range(src->i_mapping, pos_in >> PAGE_SHIFT, (pos_in + len - 1) >> PAGE_SHIFT);
+
+    nizifs_lock_two_entries(info, src->i_ino, dst->i_ino);
+    if ((retval = read_entry_with_vfs_ino(info, src->i_ino, &fe_src)) < 0)
+        goto unlock;
+    fe_dst = &fe_src;
+    if (dst != src) {
+        fe_dst = &fe_dst_buf;
+        if ((retval = read_entry_with_vfs_ino(info, dst->i_ino, fe_dst)) < 0)
+            goto unlock;
+    }
+    if (!fe_src.name[0] || !fe_dst->name[0]) {
+        retval = -ENOENT;
+        goto unlock;
+    }
+
+    s = pos_in >> NIZI_FS_BLOCK_SIZE_BITS;
+    d = pos_out >> NIZI_FS_BLOCK_SIZE_BITS;
+    count = DIV_ROUND_UP(len, NIZI_FS_BLOCK_SIZE);
+    spin_lock(&info->lock);
+    for (i = 0; i < count; i++)
+        if ((blk = fe_src.blocks[s + i]) && info->used_blocks[blk] >= NIZI_FS_MAX_BLOCK_REFS)
+            break;
+    if (i < count) {
+        spin_unlock(&info->lock);
+        retval = -EMLINK;
+        goto unlock;
+    }
+    for (i = 0; i < count; i++) {
+        if ((blk = fe_src.blocks[s + i]))
+            info->used_blocks[blk]++;
+        unreserve |= ni->delayed & (1 << (d + i));  // their dirty pages are gone
+    }
+    ni->delayed &= ~unreserve;
+    info->reserved_blocks -= hweight32(unreserve);
+    spin_unlock(&info->lock);
+
+    for (i = 0; i < count; i++) {
+        if (fe_dst->blocks[d + i])
+            nizifs_unset_data_block(info, fe_dst->blocks[d + i]);
+        fe_dst->blocks[d + i] = fe_src.blocks[s + i];
+    }
+    if ((retval = nizifs_update_file_entry(info, dst->i_ino, fe_dst)) < 0)
+        goto unlock;
+    retval = len;
+
+    if (pos_out + len > i_size_read(dst))
+        i_size_write(dst, pos_out + len);
+    dst->i_mtime = dst->i_ctime = current_time(dst);
+    mark_inode_dirty(dst);
+unlock:
+    nizifs_unlock_two_entries(info, src->i_ino, dst->i_ino);
+out:
+    unlock_two_nondirectories(src, dst);
+    return retval;
+}
+
+/* Clone what is block aligned, copy through the page cache otherwise */
+static ssize_t nizifs_copy_file_range(struct file *file_in, loff_t pos_in,
+        struct file *file_out, loff_t pos_out, size_t len, unsigned int flags) {
+    loff_t cloned;
+
+    printk(KERN_INFO "nizifs: nizifs_copy_file_range\n");
+    if (file_inode(file_in)->i_sb == file_inode(file_out)->i_sb) {
+        cloned = nizifs_remap_file_range(file_in, pos_in, file_out, pos_out, len, REMAP_FILE_CAN_SHORTEN);
+        if (cloned > 0)
+            return cloned;
+    }
+    return do_splice_direct(file_in, &pos_in, file_out, &pos_out, len, 0);
+}
+#endif
+
 const struct file_operations nizifs_fops = {
     open: generic_file_open,
     release: nizifs_file_release,
-    llseek: generic_file_llseek,
+    llseek: nizifs_file_llseek,
     #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0))
     read: do_sync_read,
     write: do_sync_write,
@@ -160,6 +993,20 @@ const struct file_operations nizifs_fops = {
     read_iter: generic_file_read_iter,
     write_iter: generic_file_write_iter,
     #endif
+    splice_read: generic_file_splice_read,      /* sendfile, splice: page cache pages go to the pipe */
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0))
+    splice_write: generic_file_splice_write,
+    #else
+    splice_write: iter_file_splice_write,
+    #endif
+
+    mmap: nizifs_file_mmap,             /* page_mkwrite reserves the blocks of shared writable mappings */
+    fallocate: nizifs_fallocate,        /* preallocate blocks, see fallocate(2) */
+    unlocked_ioctl: nizifs_ioctl,       /* FITRIM */
+    #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0))
+    copy_file_range: nizifs_copy_file_range,
+    remap_file_range: nizifs_remap_file_range,  /* FICLONE, FICLONERANGE */
+    #endif
 
     #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
     fsync: simple_sync_file
@@ -174,6 +1021,7 @@ const struct file_operations nizifs_fops = {
  * Use nizifs_fops if its a regular file
  */
 const struct file_operations nizifs_dops = {
+    unlocked_ioctl: nizifs_ioctl,   /* fstrim(8) issues FITRIM on the mount point */
     #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
     readdir: nizifs_readdir         /* called when the VFS needs to read the directory contents */
     #else
@@ -183,7 +1031,9 @@ const struct file_operations nizifs_dops = {
 
 const struct address_space_operations nizifs_aops = {
     readpage: nizifs_readpage,
+    readpages: nizifs_readpages,
     writepage: nizifs_writepage,
+    writepages: nizifs_writepages,
     write_begin: nizifs_write_begin,
     write_end: generic_write_end
 };
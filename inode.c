@@ -30,6 +30,8 @@ static int nizifs_inode_create(struct inode *parent_inode, struct dentry *dentry
     perms |= (mode & S_IRUSR) ? 4:0;
     perms |= (mode & S_IWUSR) ? 2:0;
     perms |= (mode & S_IXUSR) ? 1:0;
+    if (info->mount_opts & NIZIFS_MOUNT_COMPRESS)
+        perms |= NIZI_FS_FLAG_COMPRESSED;
 
     // Create the file in our system
     if ((ino = nizifs_create_file(info, fn, perms, &fe)) == INV_INODE)
@@ -39,6 +41,7 @@ static int nizifs_inode_create(struct inode *parent_inode, struct dentry *dentry
     file_inode = new_inode(parent_inode->i_sb);
     if (!file_inode) {
         nizifs_remove_file(info, fn);
+        nizifs_release_entry(info, ino);    // no inode to evict
         return -ENOMEM;
     }
     file_inode->i_ino = ino;
@@ -46,14 +49,16 @@ static int nizifs_inode_create(struct inode *parent_inode, struct dentry *dentry
     //file_inode->i_mode = S_IFREG | mode;
     file_inode->i_mode = S_IFREG;
     file_inode->i_mode |= (S_IRUSR|S_IRGRP|S_IROTH|S_IWUSR|S_IWGRP|S_IWOTH|S_IXUSR|S_IXGRP|S_IXOTH);
-    file_inode->i_mapping->a_ops = &nizifs_aops;
+    NIZIFS_I(file_inode)->flags = fe.perms & ~NIZI_FS_PERMS_MASK;
+    file_inode->i_op = &nizifs_file_iops;
+    file_inode->i_mapping->a_ops = (fe.perms & NIZI_FS_FLAG_COMPRESSED) ? &nizifs_compr_aops : &nizifs_aops;
     file_inode->i_fop = &nizifs_fops;
 
     if(insert_inode_locked(file_inode) < 0) {
         make_bad_inode(file_inode);
+        nizifs_remove_file(info, fn);   // before iput, whose evict frees the slot
         // TODO: what is this
         iput(file_inode);
-        nizifs_remove_file(info, fn);
         return -EIO;
     }
 
@@ -98,7 +103,9 @@ static struct dentry *nizifs_inode_lookup(struct inode *parent_inode, struct den
 
         file_inode->i_mode |= (S_IRUSR|S_IRGRP|S_IROTH|S_IWUSR|S_IWGRP|S_IWOTH|S_IXUSR|S_IXGRP|S_IXOTH);
 
-        file_inode->i_mapping->a_ops = &nizifs_aops;
+        NIZIFS_I(file_inode)->flags = fe.perms & ~NIZI_FS_PERMS_MASK;
+        file_inode->i_op = &nizifs_file_iops;
+        file_inode->i_mapping->a_ops = (fe.perms & NIZI_FS_FLAG_COMPRESSED) ? &nizifs_compr_aops : &nizifs_aops;
         file_inode->i_fop = &nizifs_fops;
         unlock_new_inode(file_inode);
     } else {
@@ -132,3 +139,77 @@ const struct inode_operations nizifs_iops = {
     unlink: nizifs_inode_unlink,        /* called by the unlink(2) system call, also rm ? */
     lookup: nizifs_inode_lookup         /* called when the VFS needs to look up an inode in a parent directory, e.g. ls, cd, ... */
 };
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0))
+/*
+ * The entry keeps no atime, so an atime update never dirties the inode. With
+ * lazytime an mtime/ctime update only makes it I_DIRTY_TIME: write_inode then
+ * waits for sync, fsync, a real change of the entry, or the dirtytime expiry
+ * (vm.dirtytime_expire_seconds)
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,18,0))
+static int nizifs_update_time(struct inode *inode, struct timespec *time, int flags)
+#else
+static int nizifs_update_time(struct inode *inode, struct timespec64 *time, int flags)
+#endif
+{
+    if (flags & S_ATIME)
+        inode->i_atime = *time;
+    if (flags & S_CTIME)
+        inode->i_ctime = *time;
+    if (flags & S_MTIME)
+        inode->i_mtime = *time;
+
+    if (flags & (S_CTIME | S_MTIME))
+        __mark_inode_dirty(inode, (inode->i_sb->s_flags & NIZIFS_SB_LAZYTIME) ? I_DIRTY_TIME : I_DIRTY_SYNC);
+    return 0;
+}
+#endif
+
+/*
+ * A size change drops the pages past the new EOF together with what they had
+ * reserved, and frees the blocks past it, see nizifs_truncate(). This is the
+ * only place blocks past EOF are freed
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+static int nizifs_setattr(struct dentry *dentry, struct iattr *attr)
+#else
+static int nizifs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr)
+#endif
+{
+    struct inode *inode = dentry->d_inode;
+    int retval;
+
+    printk(KERN_INFO "nizifs: nizifs_setattr (i_no = %ld)\n", inode->i_ino);
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0))
+    retval = inode_change_ok(inode, attr);
+    #elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+    retval = setattr_prepare(dentry, attr);
+    #else
+    retval = setattr_prepare(mnt_userns, dentry, attr);
+    #endif
+    if (retval)
+        return retval;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        if (attr->ia_size > ((loff_t)NIZI_FS_DATA_BLOCK_CNT << NIZI_FS_BLOCK_SIZE_BITS))
+            return -EFBIG;
+        if ((retval = nizifs_truncate(inode, attr->ia_size)) < 0)
+            return retval;
+    }
+
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+    setattr_copy(inode, attr);
+    #else
+    setattr_copy(mnt_userns, inode, attr);
+    #endif
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+const struct inode_operations nizifs_file_iops = {
+    setattr: nizifs_setattr,            /* chmod, truncate, ... */
+    #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0))
+    update_time: nizifs_update_time     /* called to update atime, mtime or ctime */
+    #endif
+};
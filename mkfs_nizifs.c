@@ -1,14 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>         /* for opendir() */
+#include <pthread.h>        /* link with -lpthread */
 
 #include "nizifs.h"
 
 #define NIZIFS_ENTRY_RATIO 0.10 /* 10% of all blocks */
 #define NIZIFS_ENTRY_TABLE_BLOCK_START 1
+#define NIZIFS_PACK_THREADS 8   /* max threads copying file data into the image */
 
 nizifs_super_block_t sb =
 {
@@ -37,13 +41,175 @@ void mark_data_blocks(int nizifs_handle, nizifs_super_block_t *sb)
     write(nizifs_handle, &c, 1); /* To make the file size to partition size */
 }
 
+typedef struct pack_file
+{
+    char path[4096];
+    nizifs_file_entry_t fe;
+} pack_file_t;
+
+pack_file_t *pack_files;
+int pack_count;
+int pack_next;                          /* next file to copy, taken atomically */
+int pack_failed;
+
+static int pack_cmp(const void *a, const void *b)
+{
+    return strcmp(((const pack_file_t *)a)->fe.name, ((const pack_file_t *)b)->fe.name);
+}
+
+/*
+ * Threads take files one by one, read each whole (at most
+ * NIZI_FS_DATA_BLOCK_CNT blocks) and pwrite it to its contiguous run
+ */
+void *copy_files(void *arg)
+{
+    int nizifs_handle = *(int *)arg;
+    char buf[NIZI_FS_DATA_BLOCK_CNT * NIZI_FS_BLOCK_SIZE];
+    int i, fd, len, blocks;
+
+    while ((i = __sync_fetch_and_add(&pack_next, 1)) < pack_count)
+    {
+        nizifs_file_entry_t *fe = &pack_files[i].fe;
+
+        if (!(blocks = (fe->size + NIZI_FS_BLOCK_SIZE - 1) / NIZI_FS_BLOCK_SIZE))
+            continue;
+        memset(buf, 0, sizeof(buf));
+        if ((fd = open(pack_files[i].path, O_RDONLY)) == -1)
+        {
+            perror(pack_files[i].path);
+            pack_failed = 1;
+            continue;
+        }
+        len = pread(fd, buf, fe->size, 0);
+        close(fd);
+        if (len < 0 || pwrite(nizifs_handle, buf, blocks * NIZI_FS_BLOCK_SIZE,
+                    (off_t)fe->blocks[0] * NIZI_FS_BLOCK_SIZE) != blocks * NIZI_FS_BLOCK_SIZE)
+        {
+            perror(pack_files[i].path);
+            pack_failed = 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Pack the regular files of dir into the image, without mounting it. Files
+ * are sorted by name and get the first entries in that order, which is also
+ * the order readdir returns them in, and each file gets a contiguous run right
+ * after the previous file's. The entry table is written in one go, after it
+ * the data by parallel pwrite()s. The used block counts are rebuilt from the
+ * entries at mount, there is nothing else to fill in.
+ */
+int pack_dir(int nizifs_handle, nizifs_super_block_t *sb, const char *dir)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    nizifs_file_entry_t *entries;
+    pthread_t threads[NIZIFS_PACK_THREADS];
+    char path[sizeof(pack_files->path)];
+    byte4_t next_block = sb->data_block_start;
+    int i, j, nthreads;
+
+    if ((d = opendir(dir)) == NULL)
+    {
+        perror(dir);
+        return -1;
+    }
+    entries = calloc(sb->entry_table_size, sb->block_size);
+    pack_files = calloc(sb->entry_count, sizeof(pack_file_t));
+    if (!entries || !pack_files)
+    {
+        fprintf(stderr, "Out of memory\n");
+        closedir(d);
+        goto fail;
+    }
+
+    while ((de = readdir(d)) != NULL)
+    {
+        pack_file_t *pf;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        if (strlen(de->d_name) > NIZI_FS_FILENAME_LEN || st.st_size > NIZI_FS_DATA_BLOCK_CNT * NIZI_FS_BLOCK_SIZE)
+        {
+            fprintf(stderr, "Skipping %s: name or file too long\n", path);
+            continue;
+        }
+        if (pack_count == sb->entry_count)
+        {
+            fprintf(stderr, "Too many files for %d entries\n", sb->entry_count);
+            closedir(d);
+            goto fail;
+        }
+        pf = &pack_files[pack_count];
+        strcpy(pf->path, path);
+        memset(&pf->fe, 0, sizeof(pf->fe));
+        strcpy(pf->fe.name, de->d_name);
+        pf->fe.size = st.st_size;
+        pf->fe.timestamp = st.st_mtime;
+        pf->fe.perms |= (st.st_mode & S_IRUSR) ? 4:0;
+        pf->fe.perms |= (st.st_mode & S_IWUSR) ? 2:0;
+        pf->fe.perms |= (st.st_mode & S_IXUSR) ? 1:0;
+        pack_count++;
+    }
+    closedir(d);
+
+    qsort(pack_files, pack_count, sizeof(pack_file_t), pack_cmp);
+    for (i = 0; i < pack_count; i++)
+    {
+        nizifs_file_entry_t *fe = &pack_files[i].fe;
+
+        for (j = 0; j * NIZI_FS_BLOCK_SIZE < fe->size; j++)
+        {
+            if (next_block >= sb->partition_size)
+            {
+                fprintf(stderr, "Not enough data blocks for %s\n", pack_files[i].path);
+                goto fail;
+            }
+            fe->blocks[j] = next_block++;
+        }
+        entries[i] = *fe;
+    }
+
+    if (pwrite(nizifs_handle, entries, sb->entry_table_size * sb->block_size,
+                (off_t)sb->entry_table_block_start * sb->block_size) != sb->entry_table_size * sb->block_size)
+    {
+        perror("Writing the entry table");
+        goto fail;
+    }
+    free(entries);
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > NIZIFS_PACK_THREADS)
+        nthreads = NIZIFS_PACK_THREADS;
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, copy_files, &nizifs_handle))
+            break;
+    copy_files(&nizifs_handle);     /* in case no thread could be started */
+    while (i--)
+        pthread_join(threads[i], NULL);
+
+    printf("Packed %d files into %u data blocks\n", pack_count, next_block - sb->data_block_start);
+    free(pack_files);
+    return pack_failed ? -1 : 0;
+
+fail:
+    free(entries);
+    free(pack_files);
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     int nizifs_handle;
 
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        fprintf(stderr, "Usage: %s <partition size in 512-byte blocks>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <partition size in 512-byte blocks> [directory to pack]\n", argv[0]);
         return 1;
     }
     sb.partition_size = atoi(argv[1]);
@@ -59,8 +225,14 @@ int main(int argc, char *argv[])
     }
 
     write_super_block(nizifs_handle, &sb);
-    clear_file_entries(nizifs_handle, &sb);
+    if (argc == 2)
+        clear_file_entries(nizifs_handle, &sb); /* else written in bulk by pack_dir() */
     mark_data_blocks(nizifs_handle, &sb);
+    if (argc == 3 && pack_dir(nizifs_handle, &sb, argv[2]) == -1)
+    {
+        close(nizifs_handle);
+        return 3;
+    }
     close(nizifs_handle);
 
     return 0;
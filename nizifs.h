@@ -2,8 +2,12 @@
 #define NIZIFS_H
 
 #ifdef __KERNEL__
+#include <linux/version.h>
 #include <linux/fs.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
 #endif
 
 
@@ -15,6 +19,15 @@
 #define NIZI_FS_DATA_BLOCK_CNT ((NIZI_FS_ENTRY_SIZE - (NIZI_FS_FILENAME_LEN + 1 + 3 * 4)) / 4)
 
 #define NIZI_BACKING_FILE ".nizifs.img"
+#define NIZI_FS_ENTRY_LOCKS 64          /* entry locks are hashed by entry number */
+#define NIZI_FS_MAX_BLOCK_REFS 255      /* a block is shared by at most this many clones */
+#define NIZI_FS_TRIM_CHUNK 1024         /* max blocks held back from the allocator per discard */
+#define NIZI_FS_SCAN_WORKERS 16         /* max workers counting block use at mount */
+#define NIZI_FS_SCAN_CHUNK 64           /* min entry table blocks per mount scan worker */
+
+#define NIZIFS_MOUNT_DISCARD 0x1        /* discard freed blocks in the background */
+#define NIZIFS_MOUNT_COMPRESS 0x2       /* create new files compressed */
+#define NIZIFS_DISCARD_DELAY (5 * HZ)   /* let freed blocks pile up before discarding them */
 
 typedef unsigned char byte1_t;
 typedef unsigned int byte4_t;
@@ -33,6 +46,16 @@ typedef struct nizifs_super_block
     byte4_t reserved[NIZI_FS_BLOCK_SIZE / 4 - 8];   /* Making it of NIZI_FS_BLOCK_SIZE */
 } nizifs_super_block_t;
 
+/*
+ * Only the low bits of an entry's perms are permissions, the rest are flags.
+ * A compressed file stores each cluster of NIZI_FS_CLUSTER_BLOCKS blocks either
+ * raw, or LZ4 compressed into its first blocks with the per cluster flag set
+ */
+#define NIZI_FS_PERMS_MASK 07                   /* rwx for user */
+#define NIZI_FS_FLAG_COMPRESSED 0x100           /* file data is stored in compressed clusters */
+#define NIZI_FS_CLUSTER_COMPRESSED(c) (0x10000 << (c))  /* cluster c is compressed */
+#define NIZI_FS_CLUSTER_BLOCKS 8                /* blocks per cluster, 4 KiB whatever the page size */
+
 typedef struct nizifs_file_entry
 {
     char name[NIZI_FS_FILENAME_LEN+1];
@@ -46,9 +69,44 @@ typedef struct nizifs_file_entry
 typedef struct nizifs_info {
     struct super_block *vfs_sb;         // VFS' super block
     nizifs_super_block_t sb;            // our super block
-    byte1_t *used_blocks;               // bitmap as used blocks tracker
-    spinlock_t lock;                   // protect used_blocks
+    byte1_t *used_blocks;               // number of files using each block, 0 if free
+    byte4_t free_blocks;                // number of unused data blocks
+    byte4_t reserved_blocks;            // blocks promised to delayed writes, not yet allocated
+    spinlock_t lock;                   // protect used_blocks, free_blocks and reserved_blocks
+    struct rw_semaphore dir_sem;        // create, remove (write) against lookup, readdir (read)
+    struct mutex entry_locks[NIZI_FS_ENTRY_LOCKS];  // serialize read-modify-write of an entry
+    unsigned int mount_opts;            // NIZIFS_MOUNT_*
+    byte1_t *discard_pending;           // blocks freed since the last online discard, under lock
+    unsigned long *orphans;             // entries removed while their inode lives on, not free until evicted
+    struct delayed_work discard_work;   // online discard of discard_pending
 } nizifs_info_t;
+
+#define NIZI_FS_CLUSTER_SIZE (NIZI_FS_CLUSTER_BLOCKS * NIZI_FS_BLOCK_SIZE)
+#define NIZI_FS_PAGE_CLUSTERS (PAGE_SIZE / NIZI_FS_CLUSTER_SIZE)   /* page sizes are multiples of 4 KiB */
+
+/* In-memory inode, the VFS inode is embedded */
+typedef struct nizifs_inode_info {
+    byte4_t delayed;                    // bitmask of file blocks reserved but not yet allocated
+    byte4_t prealloc;                   // blocks fallocate(FALLOC_FL_KEEP_SIZE) put past EOF, under the inode lock
+    byte4_t flags;                      // NIZI_FS_FLAG_* of the file entry
+    struct inode vfs_inode;
+} nizifs_inode_info_t;
+
+static inline nizifs_inode_info_t *NIZIFS_I(struct inode *inode) {
+    return container_of(inode, nizifs_inode_info_t, vfs_inode);
+}
+
+#ifdef SB_LAZYTIME
+#define NIZIFS_SB_LAZYTIME SB_LAZYTIME
+#else
+#define NIZIFS_SB_LAZYTIME MS_LAZYTIME
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0))
+#define nizifs_put_page(page) page_cache_release(page)
+#else
+#define nizifs_put_page(page) put_page(page)
+#endif
 #endif
 
 /*
@@ -62,6 +120,7 @@ typedef struct nizifs_info {
 #define V2N_INODE_NUM(i) ((i) - (ROOT_INODE_NUM + 1))   // NIZIFS to SFSk
 #define INV_INODE (-1)
 #define INV_BLOCK (-1)
+#define DELAYED_BLOCK (~(sector_t)0)    // placeholder mapping for delayed allocated buffers
 
 
 
@@ -80,9 +139,22 @@ extern const struct super_operations nizifs_sops;
 extern const struct file_operations nizifs_fops;
 extern const struct file_operations nizifs_dops;
 extern const struct address_space_operations nizifs_aops;
+#ifdef __KERNEL__
+int nizifs_claim_run(nizifs_info_t *info, int goal, int count);
+void nizifs_release_delayed(struct inode *inode);
+int nizifs_truncate(struct inode *inode, loff_t size);
+void nizifs_discard_work(struct work_struct *work);
+#endif
+
+/* compress.c */
+extern const struct address_space_operations nizifs_compr_aops;
+#ifdef __KERNEL__
+int nizifs_compr_reserve(struct inode *inode, pgoff_t index, loff_t end);
+#endif
 
 /* inode.c */
 extern const struct inode_operations nizifs_iops;
+extern const struct inode_operations nizifs_file_iops;
 
 #endif
 
@@ -1,6 +1,9 @@
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>       /* For blk_start_plug, ... */
+#include <linux/bio.h>          /* For bio_alloc, submit_bio_wait, ... */
+#include <linux/version.h>      /* For LINUX_VERSION_CODE & KERNEL_VERSION */
 
 #include "nizifs.h"
 #include "real_io.h"
@@ -25,11 +28,12 @@ static int read_from_nizifs(nizifs_info_t *info, byte4_t block, byte4_t offset,
     return 0;
 }
 
-static int write_to_nizifs(nizifs_info_t *info, byte4_t block, byte4_t offset, void *buf, byte4_t len) {
+static int write_to_nizifs(nizifs_info_t *info, byte4_t block, byte4_t offset, void *buf, byte4_t len, int sync) {
     byte4_t block_size = info->sb.block_size;
     byte4_t bd_block_size = info->vfs_sb->s_bdev->bd_block_size;
 
     struct buffer_head *bh;
+    int retval = 0;
 
     byte4_t abs = block * block_size + offset;
     block = abs / bd_block_size;
@@ -40,8 +44,10 @@ static int write_to_nizifs(nizifs_info_t *info, byte4_t block, byte4_t offset, v
         return -EIO;
     memcpy(bh->b_data + offset, buf, len);
     mark_buffer_dirty(bh);  // TODO: will this happen imediately??
+    if (sync)               // it will now
+        retval = sync_dirty_buffer(bh);
     brelse(bh);
-    return 0;
+    return retval;
 }
 
 /* Read a file entry from the underlying block device */
@@ -58,7 +64,61 @@ int read_entry_with_vfs_ino(nizifs_info_t *info, int vfs_ino, nizifs_file_entry_
 /* Write a file entry to underlying block device */
 int write_entry_to_nizifs(nizifs_info_t *info, int ino, nizifs_file_entry_t *fe) {
     byte4_t len = sizeof(nizifs_file_entry_t);
-    return write_to_nizifs(info, info->sb.entry_table_block_start,  ino*len, fe, len);
+    return write_to_nizifs(info, info->sb.entry_table_block_start,  ino*len, fe, len, 0);
+}
+
+/* Read a whole data block, for data that doesn't go through the block mapping helpers */
+int nizifs_read_block(nizifs_info_t *info, byte4_t block, void *buf) {
+    return read_from_nizifs(info, block, 0, buf, info->sb.block_size);
+}
+
+/*
+ * Read or write the blocks[0..count) of a cluster straight from/to @page at
+ * @offset, block i at offset + i * block size. Unmapped blocks are skipped,
+ * each physically contiguous run is a single bio. Waits for the I/O, which
+ * bypasses the block device's cache
+ */
+int nizifs_cluster_io(nizifs_info_t *info, int write, byte4_t *blocks, int count, struct page *page, unsigned offset) {
+    struct bio *bio;
+    int i, j, retval = 0;
+
+    for (i = 0; i < count && !retval; i = j) {
+        j = i + 1;
+        if (!blocks[i])
+            continue;
+        while (j < count && blocks[j] == blocks[j-1] + 1)
+            j++;
+
+        bio = bio_alloc(GFP_NOFS, 1);
+        #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0))
+        bio->bi_bdev = info->vfs_sb->s_bdev;
+        #else
+        bio_set_dev(bio, info->vfs_sb->s_bdev);
+        #endif
+        bio->bi_iter.bi_sector = (sector_t)blocks[i] << (NIZI_FS_BLOCK_SIZE_BITS - 9);
+        bio_add_page(bio, page, (j - i) << NIZI_FS_BLOCK_SIZE_BITS, offset + (i << NIZI_FS_BLOCK_SIZE_BITS));
+        #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0))
+        retval = submit_bio_wait(write ? WRITE_SYNC : READ, bio);
+        #else
+        bio_set_op_attrs(bio, write ? REQ_OP_WRITE : REQ_OP_READ, write ? REQ_SYNC : 0);
+        retval = submit_bio_wait(bio);
+        #endif
+        bio_put(bio);
+    }
+    return retval;
+}
+
+/* Start reading @count blocks from @block into the buffer cache, without waiting for them */
+void nizifs_readahead(nizifs_info_t *info, byte4_t block, byte4_t count) {
+    byte4_t bd_block_size = info->vfs_sb->s_bdev->bd_block_size;
+    sector_t first = (sector_t)block * info->sb.block_size / bd_block_size;
+    sector_t last = ((sector_t)(block + count) * info->sb.block_size + bd_block_size - 1) / bd_block_size;
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);  // so the block layer merges them into large requests
+    for (; first < last; first++)
+        sb_breadahead(info->vfs_sb, first);
+    blk_finish_plug(&plug);
 }
 
 /* Read our super block from the underlying block device */
@@ -73,49 +133,104 @@ int read_sb_from_nizifs(nizifs_info_t *info, nizifs_super_block_t *sb) {
     return 0;
 }
 
-/* Unset used blocks bit  */
-static void nizifs_unset_data_block(nizifs_info_t *info, int i) {
+/* Drop a reference to a data block, it's free once no file uses it anymore */
+void nizifs_unset_data_block(nizifs_info_t *info, int i) {
     // TODO: Here's a global lock
     spin_lock(&info->lock);
-    info->used_blocks[i] = 0;
+    if (info->used_blocks[i] && !--info->used_blocks[i]) {
+        info->free_blocks++;
+        if (info->discard_pending)
+            info->discard_pending[i] = 1;
+    }
     spin_unlock(&info->lock);
+
+    // Already queued work just picks this block up as well
+    if (info->discard_pending)
+        schedule_delayed_work(&info->discard_work, NIZIFS_DISCARD_DELAY);
+}
+
+/*
+ * Entry locks serialize read-modify-write cycles of one entry, e.g. get_block
+ * against write_inode of the same file. They are hashed by entry number, so
+ * unrelated files almost never wait on each other.
+ * Lock order: info->dir_sem, entry lock, info->lock
+ */
+void nizifs_lock_entry(nizifs_info_t *info, int vfs_ino) {
+    mutex_lock(&info->entry_locks[V2N_INODE_NUM(vfs_ino) % NIZI_FS_ENTRY_LOCKS]);
+}
+
+void nizifs_unlock_entry(nizifs_info_t *info, int vfs_ino) {
+    mutex_unlock(&info->entry_locks[V2N_INODE_NUM(vfs_ino) % NIZI_FS_ENTRY_LOCKS]);
 }
 
+/* Both entries of a clone, in hash order. They may share a lock */
+void nizifs_lock_two_entries(nizifs_info_t *info, int vfs_ino1, int vfs_ino2) {
+    int l1 = V2N_INODE_NUM(vfs_ino1) % NIZI_FS_ENTRY_LOCKS;
+    int l2 = V2N_INODE_NUM(vfs_ino2) % NIZI_FS_ENTRY_LOCKS;
+
+    if (l1 == l2) {
+        mutex_lock(&info->entry_locks[l1]);
+        return;
+    }
+    mutex_lock(&info->entry_locks[min(l1, l2)]);
+    mutex_lock_nested(&info->entry_locks[max(l1, l2)], SINGLE_DEPTH_NESTING);
+}
+
+void nizifs_unlock_two_entries(nizifs_info_t *info, int vfs_ino1, int vfs_ino2) {
+    int l1 = V2N_INODE_NUM(vfs_ino1) % NIZI_FS_ENTRY_LOCKS;
+    int l2 = V2N_INODE_NUM(vfs_ino2) % NIZI_FS_ENTRY_LOCKS;
+
+    mutex_unlock(&info->entry_locks[l1]);
+    if (l1 != l2)
+        mutex_unlock(&info->entry_locks[l2]);
+}
+
+/*
+ * Update the given fields of an entry. No blocks are freed here, the size on
+ * the device lags behind i_size, truncation frees them, see nizifs_truncate().
+ * Returns 1 if the entry had to be written, 0 if it was up to date
+ */
 int nizifs_update(nizifs_info_t *info, int vfs_ino, int *size, int *timestamp, int *perms) {
-    nizifs_file_entry_t fe;
-    int i, retval;
+    nizifs_file_entry_t fe, old;
+    int retval;
 
+    nizifs_lock_entry(info, vfs_ino);
     if ((retval = read_entry_with_vfs_ino(info, vfs_ino, &fe)) < 0)
-        return retval;
+        goto out;
+    if (!fe.name[0])    // removed while still open, don't bring the entry back
+        goto out;
+    old = fe;
     if (size) fe.size = *size;
     if (timestamp) fe.timestamp = *timestamp;
-    if (perms && (*perms <= 07)) fe.perms = *perms;
-
-    // TODO: why i start from this?
-    for (i = (fe.size+info->sb.block_size-1) / info->sb.block_size; i < NIZI_FS_DATA_BLOCK_CNT; i++) {
-        if (fe.blocks[i]) {
-            nizifs_unset_data_block(info, fe.blocks[i]);
-            fe.blocks[i] = 0;
-        }
-    }
-
-    return write_entry_to_nizifs(info, V2N_INODE_NUM(vfs_ino), &fe);
+    if (perms && (*perms <= NIZI_FS_PERMS_MASK))   // keep the flags
+        fe.perms = (fe.perms & ~NIZI_FS_PERMS_MASK) | *perms;
+    if (!memcmp(&fe, &old, sizeof(fe)))  // nothing to write
+        goto out;
+
+    if ((retval = write_entry_to_nizifs(info, V2N_INODE_NUM(vfs_ino), &fe)) == 0)
+        retval = 1;
+out:
+    nizifs_unlock_entry(info, vfs_ino);
+    return retval;
 }
 
+/* Write back a whole entry, the caller holds its entry lock since it was read */
 int nizifs_update_file_entry(nizifs_info_t *info, int vfs_ino, nizifs_file_entry_t *fe) {
     return write_entry_to_nizifs(info, V2N_INODE_NUM(vfs_ino), fe);
 }
 
 
 int nizifs_create_file(nizifs_info_t *info, char *fn, int perms, nizifs_file_entry_t *fe) {
-    int ino, free_ino, i;
+    int ino, free_ino, i, retval;
     free_ino = INV_INODE;
 
-    // Get a free ino to assign
+    down_write(&info->dir_sem);
+
+    // Get a free ino to assign, no other create or remove can run meanwhile
     for (ino = 0; ino < info->sb.entry_count; ino++) {
         if (read_entry_from_nizifs(info, ino, fe) < 0)
-            return INV_INODE;
-        if (!fe->name[0]) {
+            goto out;
+        if (!fe->name[0] && !test_bit(ino, info->orphans)) {
             free_ino = ino;
             break;
         }
@@ -123,7 +238,7 @@ int nizifs_create_file(nizifs_info_t *info, char *fn, int perms, nizifs_file_ent
 
     if (free_ino == INV_INODE) {
         printk(KERN_ERR "No entries left\n");
-        return INV_INODE;
+        goto out;
     }
 
     strncpy(fe->name, fn, NIZI_FS_FILENAME_LEN);
@@ -136,14 +251,19 @@ int nizifs_create_file(nizifs_info_t *info, char *fn, int perms, nizifs_file_ent
         fe->blocks[i] = 0;
 
     // Write the entry to block device
-    if (write_entry_to_nizifs(info, free_ino, fe) < 0)
-        return INV_INODE;
-
-    return N2V_INODE_NUM(free_ino);
+    nizifs_lock_entry(info, N2V_INODE_NUM(free_ino));
+    retval = write_entry_to_nizifs(info, free_ino, fe);
+    nizifs_unlock_entry(info, N2V_INODE_NUM(free_ino));
+    if (retval < 0)
+        free_ino = INV_INODE;
+
+out:
+    up_write(&info->dir_sem);
+    return free_ino == INV_INODE ? INV_INODE : N2V_INODE_NUM(free_ino);
 }
 
 // TODO: This could be slow
-int nizifs_lookup_file(nizifs_info_t *info, char *fn, nizifs_file_entry_t *fe) {
+static int __nizifs_lookup_file(nizifs_info_t *info, char *fn, nizifs_file_entry_t *fe) {
     int ino;
     for (ino = 0; ino < info->sb.entry_count; ino++) {
         if (read_entry_from_nizifs(info, ino, fe) < 0)
@@ -156,26 +276,51 @@ int nizifs_lookup_file(nizifs_info_t *info, char *fn, nizifs_file_entry_t *fe) {
     return INV_INODE;
 }
 
+int nizifs_lookup_file(nizifs_info_t *info, char *fn, nizifs_file_entry_t *fe) {
+    int vfs_ino;
+    down_read(&info->dir_sem);
+    vfs_ino = __nizifs_lookup_file(info, fn, fe);
+    up_read(&info->dir_sem);
+    return vfs_ino;
+}
+
 int nizifs_remove_file(nizifs_info_t *info, char *fn) {
-    int vfs_ino, i;
+    int vfs_ino, i, retval;
     nizifs_file_entry_t fe;
 
-    if ((vfs_ino = nizifs_lookup_file(info, fn, &fe)) == INV_INODE) {
+    down_write(&info->dir_sem);
+    if ((vfs_ino = __nizifs_lookup_file(info, fn, &fe)) == INV_INODE) {
         printk(KERN_ERR "File %s doesn't exist\n", fn);
-        return INV_INODE;
+        goto out;
     }
 
-    // Free up all allocated blocks
+    // Reread under the entry lock, get_block may have just allocated a block
+    nizifs_lock_entry(info, vfs_ino);
+    if ((retval = read_entry_with_vfs_ino(info, vfs_ino, &fe)) < 0)
+        goto unlock;
+
+    // Free up all allocated blocks, preallocated ones need not be contiguous from 0
     for (i = 0; i < NIZI_FS_DATA_BLOCK_CNT; i++) {
         if (!fe.blocks[i])
-            break;
+            continue;
         nizifs_unset_data_block(info, fe.blocks[i]);
     }
 
-    // Write the empty file entry back
+    // Write the empty file entry back. The slot stays taken until the inode is
+    // evicted, an open file would otherwise write into the entry of the next one
     memset(&fe, 0, sizeof(nizifs_file_entry_t));
-    if (write_entry_to_nizifs(info, V2N_INODE_NUM(vfs_ino), &fe) < 0)
-        return INV_INODE;
+    if ((retval = write_entry_to_nizifs(info, V2N_INODE_NUM(vfs_ino), &fe)) == 0)
+        set_bit(V2N_INODE_NUM(vfs_ino), info->orphans);
+unlock:
+    nizifs_unlock_entry(info, vfs_ino);
+    if (retval < 0)
+        vfs_ino = INV_INODE;
+out:
+    up_write(&info->dir_sem);
     return vfs_ino;
 }
 
+/* The inode of a removed entry is gone, its slot can be reused */
+void nizifs_release_entry(nizifs_info_t *info, int vfs_ino) {
+    clear_bit(V2N_INODE_NUM(vfs_ino), info->orphans);
+}
@@ -6,6 +6,16 @@ int read_sb_from_nizifs(nizifs_info_t *info, nizifs_super_block_t *sb);
 int read_entry_from_nizifs(nizifs_info_t *info, int ino, nizifs_file_entry_t *fe);
 int read_entry_with_vfs_ino(nizifs_info_t *info, int vfs_ino, nizifs_file_entry_t *fe);
 
+void nizifs_lock_entry(nizifs_info_t *info, int vfs_ino);
+void nizifs_unlock_entry(nizifs_info_t *info, int vfs_ino);
+void nizifs_lock_two_entries(nizifs_info_t *info, int vfs_ino1, int vfs_ino2);
+void nizifs_unlock_two_entries(nizifs_info_t *info, int vfs_ino1, int vfs_ino2);
+
+int nizifs_read_block(nizifs_info_t *info, byte4_t block, void *buf);
+int nizifs_cluster_io(nizifs_info_t *info, int write, byte4_t *blocks, int count, struct page *page, unsigned offset);
+void nizifs_unset_data_block(nizifs_info_t *info, int i);
+void nizifs_readahead(nizifs_info_t *info, byte4_t block, byte4_t count);
+
 int nizifs_update(nizifs_info_t *info, int vfs_ino, int *size, int *timestamp, int *perms);
 int nizifs_update_file_entry(nizifs_info_t *info, int vfs_ino, nizifs_file_entry_t *fe);
 
@@ -13,5 +23,6 @@ int nizifs_update_file_entry(nizifs_info_t *info, int vfs_ino, nizifs_file_entry
 int nizifs_lookup_file(nizifs_info_t *info, char *fn, nizifs_file_entry_t *fe);
 int nizifs_create_file(nizifs_info_t *info, char *fn, int perms, nizifs_file_entry_t *fe);
 int nizifs_remove_file(nizifs_info_t *info, char *fn);
+void nizifs_release_entry(nizifs_info_t *info, int vfs_ino);
 
 #endif
@@ -5,18 +5,65 @@
 #include <linux/fs.h>           /* For system calls, structures, ... */
 #include <linux/errno.h>        /* For error codes */
 #include <linux/slab.h>         /* For kzalloc, kfree, ... */
+#include <linux/vmalloc.h>      /* For vmalloc, vzalloc, vfree */
+#include <linux/blkdev.h>       /* For blk_queue_discard */
+#include <linux/parser.h>       /* For match_token, ... */
+#include <linux/seq_file.h>     /* For seq_puts */
+#include <linux/statfs.h>       /* For struct kstatfs */
+#include <linux/cpumask.h>      /* For num_online_cpus */
 
 #include "nizifs.h"             /* For nizifs related defines, data structures, ... */
 #include "real_io.h"            /* direct access to the underlying block device */
 
 
 struct inode *nizifs_root_inode;
+static struct kmem_cache *nizifs_inode_cachep;
+
+/* Counts the block use of the entry table blocks [first, last) */
+struct nizifs_scan {
+    struct work_struct work;
+    nizifs_info_t *info;
+    byte4_t first, last;
+    int retval;
+};
+
+static void nizifs_scan_entries(struct work_struct *work) {
+    struct nizifs_scan *scan = container_of(work, struct nizifs_scan, work);
+    nizifs_info_t *info = scan->info;
+    byte1_t *used_blocks = info->used_blocks;
+    int per_block = info->sb.block_size / sizeof(nizifs_file_entry_t);
+    nizifs_file_entry_t *fe;
+    byte4_t b, blk;
+    int i, j;
+
+    if (!(fe = kmalloc(info->sb.block_size, GFP_KERNEL))) {
+        scan->retval = -ENOMEM;
+        return;
+    }
+    for (b = scan->first; b < scan->last; b++) {
+        if ((scan->retval = nizifs_read_block(info, info->sb.entry_table_block_start + b, fe)) < 0)
+            break;
+        // other workers count into the same map, take the lock once per table block
+        spin_lock(&info->lock);
+        for (i = 0; i < per_block && b * per_block + i < info->sb.entry_count; i++) {
+            if (!fe[i].name[0]) continue;
+            for (j = 0; j < NIZI_FS_DATA_BLOCK_CNT; j++) {
+                blk = fe[i].blocks[j];
+                if (blk == 0 || blk >= info->sb.partition_size) continue;
+                if (used_blocks[blk] < NIZI_FS_MAX_BLOCK_REFS)   // cloned blocks are shared
+                    used_blocks[blk]++;
+            }
+        }
+        spin_unlock(&info->lock);
+    }
+    kfree(fe);
+}
 
 static int init_nizifs_info(nizifs_info_t *info) {
 
-    int retval, i, j;
+    int retval, i, workers;
     byte1_t *used_blocks;
-    nizifs_file_entry_t fe; // no need to keep after this function, so not a pointer
+    struct nizifs_scan *scans;
 
     // fill in our self super block
     if ((retval = read_sb_from_nizifs(info, &info->sb)) < 0)
@@ -35,28 +82,121 @@ static int init_nizifs_info(nizifs_info_t *info) {
         used_blocks[i] = 1;
     for (i = info->sb.data_block_start; i < info->sb.partition_size; i++)
         used_blocks[i] = 0;
+    info->used_blocks = used_blocks;
+    if (!(info->orphans = vzalloc(BITS_TO_LONGS(info->sb.entry_count) * sizeof(unsigned long)))) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    spin_lock_init(&info->lock);
 
-    for (i = 0; i < info->sb.entry_count; i++) {
-        if( (retval = read_entry_from_nizifs(info, i, &fe) < 0 )) {
-            vfree(used_blocks); // some thing wrong, need to free used_blocks and exit;
-            return retval;
-        }
-        if (!fe.name[0]) continue;
-        for(j = 0; j < NIZI_FS_DATA_BLOCK_CNT; j++) {
-            if (fe.blocks[j] == 0) break;
-            used_blocks[fe.blocks[j]] = 1;
-        }
+    /*
+     * The entry table is one contiguous region: get all of it in flight at
+     * once, then let up to a worker per cpu count block use over parts of it
+     * as the reads complete. This thread scans the first part itself.
+     */
+    nizifs_readahead(info, info->sb.entry_table_block_start, info->sb.entry_table_size);
+    workers = min_t(int, num_online_cpus(), NIZI_FS_SCAN_WORKERS);
+    workers = clamp_t(int, info->sb.entry_table_size / NIZI_FS_SCAN_CHUNK, 1, workers);
+    if (!(scans = kcalloc(workers, sizeof(struct nizifs_scan), GFP_KERNEL))) {
+        retval = -ENOMEM;
+        goto out;
     }
+    for (i = 0; i < workers; i++) {
+        scans[i].info = info;
+        scans[i].first = (byte8_t)info->sb.entry_table_size * i / workers;
+        scans[i].last = (byte8_t)info->sb.entry_table_size * (i + 1) / workers;
+        INIT_WORK(&scans[i].work, nizifs_scan_entries);
+        if (i)
+            queue_work(system_unbound_wq, &scans[i].work);
+    }
+    nizifs_scan_entries(&scans[0].work);
+    for (i = 1; i < workers; i++)
+        flush_work(&scans[i].work);
+    for (i = 0; i < workers; i++)
+        if (scans[i].retval < 0)
+            retval = scans[i].retval;
+    kfree(scans);
+    if (retval < 0)
+        goto out;
+
+    info->free_blocks = 0;
+    for (i = info->sb.data_block_start; i < info->sb.partition_size; i++)
+        if (!used_blocks[i])
+            info->free_blocks++;
+    info->reserved_blocks = 0;
 
-    info->used_blocks = used_blocks;
     info->vfs_sb->s_fs_info = info;
-    spin_lock_init(&info->lock);
+    INIT_DELAYED_WORK(&info->discard_work, nizifs_discard_work);
+    init_rwsem(&info->dir_sem);
+    for (i = 0; i < NIZI_FS_ENTRY_LOCKS; i++)
+        mutex_init(&info->entry_locks[i]);
     return 0;
+
+out:
+    vfree(used_blocks); // some thing wrong, need to free used_blocks and exit
+    info->used_blocks = NULL;
+    vfree(info->orphans);
+    info->orphans = NULL;
+    return retval;
 }
 
 static void free_nizifs_info(nizifs_info_t *info) {
+    cancel_delayed_work_sync(&info->discard_work);
+    if (info->discard_pending)
+        vfree(info->discard_pending);
     if (info->used_blocks)
         vfree(info->used_blocks);
+    if (info->orphans)
+        vfree(info->orphans);
+}
+
+enum { Opt_discard, Opt_nodiscard, Opt_compress, Opt_nocompress, Opt_err };
+
+static const match_table_t tokens = {
+    {Opt_discard, "discard"},           /* discard freed blocks, batched in the background */
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_compress, "compress"},         /* files created from now on are LZ4 compressed */
+    {Opt_nocompress, "nocompress"},
+    {Opt_err, NULL}
+};
+
+static int nizifs_parse_options(nizifs_info_t *info, char *options) {
+    char *p;
+    substring_t args[MAX_OPT_ARGS];
+
+    if (!options)
+        return 0;
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        switch (match_token(p, tokens, args)) {
+        case Opt_discard:
+            info->mount_opts |= NIZIFS_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            info->mount_opts &= ~NIZIFS_MOUNT_DISCARD;
+            break;
+        case Opt_compress:
+            info->mount_opts |= NIZIFS_MOUNT_COMPRESS;
+            break;
+        case Opt_nocompress:
+            info->mount_opts &= ~NIZIFS_MOUNT_COMPRESS;
+            break;
+        default:
+            printk(KERN_ERR "nizifs: unrecognized mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+
+    if (info->mount_opts & NIZIFS_MOUNT_DISCARD) {
+        if (!blk_queue_discard(bdev_get_queue(info->vfs_sb->s_bdev))) {
+            printk(KERN_WARNING "nizifs: device does not support discard, ignoring\n");
+            info->mount_opts &= ~NIZIFS_MOUNT_DISCARD;
+        } else if (!(info->discard_pending = (byte1_t *)(vzalloc(info->sb.partition_size)))) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
 }
 
 /* TODO: when is this called?
@@ -66,15 +206,103 @@ static void nizifs_put_super(struct super_block *sb) {
     nizifs_info_t *info = (nizifs_info_t *)(sb->s_fs_info);
     printk(KERN_INFO "nizifs: nizifs_put_super\n");
     if (info) {
+        if (info->discard_pending)  // don't leave the last batch behind
+            flush_delayed_work(&info->discard_work);
         free_nizifs_info(info);
         kfree(info);
         sb->s_fs_info = NULL;
     }
 }
 
+static struct inode *nizifs_alloc_inode(struct super_block *sb) {
+    nizifs_inode_info_t *ni;
+    if (!(ni = (nizifs_inode_info_t *)(kmem_cache_alloc(nizifs_inode_cachep, GFP_KERNEL))))
+        return NULL;
+    ni->delayed = 0;
+    ni->prealloc = 0;
+    ni->flags = 0;
+    return &ni->vfs_inode;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+static void nizifs_destroy_inode(struct inode *inode) {
+    kmem_cache_free(nizifs_inode_cachep, NIZIFS_I(inode));
+}
+#else
+static void nizifs_i_callback(struct rcu_head *head) {
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+    kmem_cache_free(nizifs_inode_cachep, NIZIFS_I(inode));
+}
+static void nizifs_destroy_inode(struct inode *inode) {
+    call_rcu(&inode->i_rcu, nizifs_i_callback);
+}
+#endif
+
+static void nizifs_init_once(void *foo) {
+    nizifs_inode_info_t *ni = (nizifs_inode_info_t *)foo;
+    inode_init_once(&ni->vfs_inode);
+}
+
+/*
+ * Dirty pages of a file deleted before writeback are simply dropped here,
+ * so give back the space they had reserved without ever allocating it. The
+ * entry of a deleted file becomes free for reuse only now
+ */
+static void nizifs_evict_inode(struct inode *inode) {
+    printk(KERN_INFO "nizifs: nizifs_evict_inode (i_no = %ld)\n", inode->i_ino);
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0))
+    truncate_inode_pages(&inode->i_data, 0);
+    #else
+    truncate_inode_pages_final(&inode->i_data);
+    #endif
+    nizifs_release_delayed(inode);
+    if (inode->i_ino != ROOT_INODE_NUM)
+        nizifs_release_entry((nizifs_info_t *)(inode->i_sb->s_fs_info), inode->i_ino);
+    #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,5,0))
+    end_writeback(inode);
+    #else
+    clear_inode(inode);
+    #endif
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0))
+static int nizifs_show_options(struct seq_file *seq, struct vfsmount *vfs) {
+    nizifs_info_t *info = (nizifs_info_t *)(vfs->mnt_sb->s_fs_info);
+#else
+static int nizifs_show_options(struct seq_file *seq, struct dentry *root) {
+    nizifs_info_t *info = (nizifs_info_t *)(root->d_sb->s_fs_info);
+#endif
+    if (info->mount_opts & NIZIFS_MOUNT_DISCARD)
+        seq_puts(seq, ",discard");
+    if (info->mount_opts & NIZIFS_MOUNT_COMPRESS)
+        seq_puts(seq, ",compress");
+    return 0;
+}
+
+/* For df, also tells how well compressed files shrink */
+static int nizifs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    nizifs_info_t *info = (nizifs_info_t *)(dentry->d_sb->s_fs_info);
+
+    buf->f_type = info->sb.type;
+    buf->f_bsize = info->sb.block_size;
+    buf->f_blocks = info->sb.partition_size - info->sb.data_block_start;
+    spin_lock(&info->lock);
+    buf->f_bfree = info->free_blocks;
+    buf->f_bavail = info->free_blocks - info->reserved_blocks;
+    spin_unlock(&info->lock);
+    buf->f_files = info->sb.entry_count;
+    buf->f_namelen = NIZI_FS_FILENAME_LEN;
+    return 0;
+}
+
+/* The entry keeps a single timestamp, the latest of mtime and ctime */
+static int nizifs_inode_timestamp(struct inode *inode) {
+    return inode->i_mtime.tv_sec > inode->i_ctime.tv_sec ? inode->i_mtime.tv_sec : inode->i_ctime.tv_sec;
+}
+
 static int nizifs_write_inode(struct inode *inode, struct writeback_control *wbc) {
     nizifs_info_t *info = (nizifs_info_t *)(inode->i_sb->s_fs_info);
-    int size, timestamp, perms;
+    int size, timestamp, perms, retval;
     printk(KERN_INFO "nizifs: nizifs_write_inode (i_no = %ld)\n", inode->i_ino);
 
     if (!(S_ISREG(inode->i_mode)))  // currently we only handle regular files
@@ -83,7 +311,7 @@ static int nizifs_write_inode(struct inode *inode, struct writeback_control *wbc
     size = i_size_read(inode);
 
     // Set timestamp in our filesystem
-    timestamp = inode->i_mtime.tv_sec > inode->i_ctime.tv_sec ? inode->i_mtime.tv_sec : inode->i_ctime.tv_sec;
+    timestamp = nizifs_inode_timestamp(inode);
 
     // Set file's permission in our filesystem
     perms = 0;
@@ -93,12 +321,17 @@ static int nizifs_write_inode(struct inode *inode, struct writeback_control *wbc
 
     printk(KERN_INFO "nizifs: nizifs_write_inode with %d bytes, perm %o\n", size, perms);
 
-    return nizifs_update(info, inode->i_ino, &size, &timestamp, &perms);
+    retval = nizifs_update(info, inode->i_ino, &size, &timestamp, &perms);
+    return retval < 0 ? retval : 0;
 }
 
 const struct super_operations nizifs_sops = {
+    alloc_inode: nizifs_alloc_inode,    /* allocate our inode with the VFS one embedded */
+    destroy_inode: nizifs_destroy_inode,
+    evict_inode: nizifs_evict_inode,    /* called when the last reference of an inode is dropped */
     put_super: nizifs_put_super,        /* called when the VFS wishes to free the superblock (i.e. unmount) */
-    //statfs: nizifs_statfs             /* for df to show it up */
+    statfs: nizifs_statfs,              /* for df to show it up */
+    show_options: nizifs_show_options,  /* mount options in /proc/mounts */
     write_inode: nizifs_write_inode     /* called when the VFS needs to write an inode to disc */
 };
 
@@ -118,6 +351,12 @@ static int nizifs_fill_super(struct super_block *sb, void *data, int silent) {
         return -EIO;
     }
 
+    if (nizifs_parse_options(info, (char *)data) < 0) {
+        free_nizifs_info(info);
+        kfree(info);
+        return -EINVAL;
+    }
+
     /* Fill the VFS super block */
     sb->s_magic = info->sb.type;            // magic number
 	sb->s_type = &nizifs;                   // file_system_type
@@ -194,12 +433,21 @@ struct file_system_type nizifs =
 };
 
 static int __init nizifs_init(void) {
-	int err = register_filesystem(&nizifs);
+	int err;
+	nizifs_inode_cachep = kmem_cache_create("nizifs_inode_cache", sizeof(nizifs_inode_info_t),
+	        0, SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, nizifs_init_once);
+	if (!nizifs_inode_cachep)
+		return -ENOMEM;
+	err = register_filesystem(&nizifs);
+	if (err)
+		kmem_cache_destroy(nizifs_inode_cachep);
 	return err;
 }
 
 static void __exit nizifs_exit(void) {
 	unregister_filesystem(&nizifs);
+	rcu_barrier();  // make sure all delayed rcu free inodes are flushed
+	kmem_cache_destroy(nizifs_inode_cachep);
 }
 
 module_init(nizifs_init);
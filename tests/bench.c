@@ -0,0 +1,167 @@
+#define _GNU_SOURCE         /* for syncfs() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/statfs.h>     /* for statfs() */
+#include <sys/time.h>       /* for gettimeofday() */
+#include <fcntl.h>          /* for open() */
+#include <unistd.h>         /* for close(), syncfs() */
+#include <pthread.h>        /* link with -lpthread */
+#include <sys/socket.h>     /* for socketpair() */
+#include <sys/sendfile.h>   /* for sendfile() */
+
+#define BENCH_FILES 64
+#define BENCH_FILE_SIZE 4096    /* one compression cluster */
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Needs root, otherwise the reads are served from the page cache */
+static void drop_caches(void) {
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1)
+        printf("  (could not drop caches, reads are cached)\n");
+    if (fd >= 0)
+        close(fd);
+}
+
+/* Log like text, compresses well */
+static void fill_text(char *buf, int len) {
+    int off = 0, line;
+    for (line = 0; off < len; line++)
+        off += snprintf(buf + off, len - off, "%06d INFO request served in %d ms\n", line, line % 50);
+}
+
+/**
+ * Write then read back BENCH_FILES files in dir, report MB/s and the space used
+ */
+void bench_files(char *dir) {
+    char fn[256], buf[BENCH_FILE_SIZE];
+    struct statfs before, after;
+    double t, wr, rd;
+    long used;
+    int i, fd, dirfd;
+
+    fill_text(buf, sizeof(buf));
+    dirfd = open(dir, O_RDONLY);
+    syncfs(dirfd);
+    statfs(dir, &before);
+
+    t = now();
+    for (i = 0; i < BENCH_FILES; i++) {
+        snprintf(fn, sizeof(fn), "%s/b%d", dir, i);
+        fd = open(fn, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+        write(fd, buf, sizeof(buf));
+        close(fd);
+    }
+    syncfs(dirfd);
+    wr = now() - t;
+    statfs(dir, &after);
+
+    drop_caches();
+    t = now();
+    for (i = 0; i < BENCH_FILES; i++) {
+        snprintf(fn, sizeof(fn), "%s/b%d", dir, i);
+        fd = open(fn, O_RDONLY);
+        read(fd, buf, sizeof(buf));
+        close(fd);
+    }
+    rd = now() - t;
+
+    used = (long)(before.f_bfree - after.f_bfree) * after.f_bsize;
+    printf("%s: write %.2f MB/s, read %.2f MB/s, ratio %.2f\n", dir,
+            BENCH_FILES * BENCH_FILE_SIZE / wr / 1e6, BENCH_FILES * BENCH_FILE_SIZE / rd / 1e6,
+            used > 0 ? (double)BENCH_FILES * BENCH_FILE_SIZE / used : 0.0);
+
+    for (i = 0; i < BENCH_FILES; i++) {
+        snprintf(fn, sizeof(fn), "%s/b%d", dir, i);
+        unlink(fn);
+    }
+    close(dirfd);
+}
+
+#define SENDFILE_FILES 16
+#define SENDFILE_FILE_SIZE 4608 /* the largest file nizifs holds */
+#define SENDFILE_ROUNDS 2000
+
+static void *drain(void *arg) {
+    char buf[65536];
+    while (read((int)(long)arg, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+/* Serve every file to the socket SENDFILE_ROUNDS times, with sendfile or through a user buffer */
+static double serve_files(char *dir, int sock, int use_sendfile) {
+    char fn[256], buf[SENDFILE_FILE_SIZE];
+    double t = now();
+    off_t off;
+    int i, r, fd;
+
+    for (r = 0; r < SENDFILE_ROUNDS; r++) {
+        for (i = 0; i < SENDFILE_FILES; i++) {
+            snprintf(fn, sizeof(fn), "%s/f%d", dir, i);
+            fd = open(fn, O_RDONLY);
+            if (use_sendfile) {
+                off = 0;
+                sendfile(sock, fd, &off, SENDFILE_FILE_SIZE);
+            } else {
+                read(fd, buf, sizeof(buf));
+                write(sock, buf, sizeof(buf));
+            }
+            close(fd);
+        }
+    }
+    return (double)SENDFILE_ROUNDS * SENDFILE_FILES * SENDFILE_FILE_SIZE / (now() - t) / 1e6;
+}
+
+/**
+ * Serving files over a local socket, read()/write() against sendfile()
+ */
+void bench_sendfile(char *dir) {
+    char fn[256], buf[SENDFILE_FILE_SIZE];
+    int i, fd, sv[2];
+    pthread_t reader;
+
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < SENDFILE_FILES; i++) {
+        snprintf(fn, sizeof(fn), "%s/f%d", dir, i);
+        fd = open(fn, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+        write(fd, buf, sizeof(buf));
+        close(fd);
+    }
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    pthread_create(&reader, NULL, drain, (void *)(long)sv[1]);
+    serve_files(dir, sv[0], 1);     // warm up the page cache
+    printf("%s: read/write %.2f MB/s\n", dir, serve_files(dir, sv[0], 0));
+    printf("%s: sendfile %.2f MB/s\n", dir, serve_files(dir, sv[0], 1));
+    close(sv[0]);
+    pthread_join(reader, NULL);
+    close(sv[1]);
+
+    for (i = 0; i < SENDFILE_FILES; i++) {
+        snprintf(fn, sizeof(fn), "%s/f%d", dir, i);
+        unlink(fn);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "compress") == 0) {
+        // e.g. mount -t nizifs /dev/loop0 /mnt/plain; mount -t nizifs -o compress /dev/loop1 /mnt/lz4
+        bench_files(argv[2]);
+        bench_files(argv[3]);
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "sendfile") == 0) {
+        bench_sendfile(argv[2]);
+        return 0;
+    }
+    fprintf(stderr, "Usage: %s compress <plain mount> <compress mount>\n", argv[0]);
+    fprintf(stderr, "       %s sendfile <mount>\n", argv[0]);
+    return 1;
+}
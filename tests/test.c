@@ -1,9 +1,17 @@
+#define _GNU_SOURCE         /* for fallocate() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>      /* for O_CREAT */
 #include <fcntl.h>          /* for open() */
 #include <unistd.h>         /* for close() */
+#include <string.h>         /* for memset() */
+#include <pthread.h>        /* for the create/unlink storm, link with -lpthread */
+#include <dirent.h>         /* for opendir() */
+#include <sys/ioctl.h>      /* for ioctl() */
+#include <linux/fs.h>       /* for FICLONE */
+#include <sys/mman.h>       /* for mmap() */
 
+static char dir[] = "/mnt/nizifs";
 static char path[] = "/mnt/nizifs/test.txt";
 static char str[] = "Hello World";
 
@@ -49,10 +57,217 @@ void test_pwrite_pread(char *path) {
     close(fd);
 }
 
+/**
+ * Preallocated blocks must read back as zeros
+ */
+void test_fallocate(char *path) {
+    int fd, i, zeros = 0;
+    ssize_t res;
+    char buf[2048];
+
+    fd = open(path, O_CREAT|O_RDWR, 0644);
+    res = fallocate(fd, 0, 0, sizeof(buf));
+    printf("fallocate: %ld\n", res);
+    memset(buf, 1, sizeof(buf));
+    res = pread(fd, buf, sizeof(buf), 0);
+    for (i = 0; i < res; i++)
+        zeros += !buf[i];
+    printf("pread: %ld, %d zero bytes\n", res, zeros);
+    res = fallocate(fd, FALLOC_FL_KEEP_SIZE, sizeof(buf), sizeof(buf));
+    printf("fallocate keep size: %ld, size %ld\n", res, lseek(fd, 0, SEEK_END));
+    close(fd);
+}
+
+/**
+ * Writing past EOF leaves a hole that reads as zeros and is skipped by SEEK_DATA
+ */
+void test_sparse(char *path) {
+    int fd, i, zeros = 0;
+    ssize_t res;
+    char buf[3000];
+
+    unlink(path);
+    fd = open(path, O_CREAT|O_RDWR, 0644);
+    res = pwrite(fd, str, sizeof(str), sizeof(buf));
+    printf("pwrite past EOF: %ld\n", res);
+    memset(buf, 1, sizeof(buf));
+    res = pread(fd, buf, sizeof(buf), 0);
+    for (i = 0; i < res; i++)
+        zeros += !buf[i];
+    printf("pread hole: %ld, %d zero bytes\n", res, zeros);
+    printf("SEEK_DATA: %ld, SEEK_HOLE: %ld\n", lseek(fd, 0, SEEK_DATA), lseek(fd, 0, SEEK_HOLE));
+    close(fd);
+}
+
+/**
+ * Truncated before writeback, growing again must read zeros, not old data
+ */
+void test_truncate(char *path) {
+    int fd, i, zeros = 0;
+    ssize_t res;
+    char buf[4096];
+
+    unlink(path);
+    fd = open(path, O_CREAT|O_RDWR, 0644);
+    memset(buf, 'x', sizeof(buf));
+    res = pwrite(fd, buf, sizeof(buf), 0);
+    ftruncate(fd, 0);
+    res = pwrite(fd, str, sizeof(str), 0);
+    fsync(fd);
+    ftruncate(fd, sizeof(buf));
+    res = pread(fd, buf, sizeof(buf), 0);
+    for (i = sizeof(str); i < res; i++)
+        zeros += !buf[i];
+    printf("pread after truncate and grow: %ld, %d of %ld zero bytes\n", res, zeros, res - (ssize_t)sizeof(str));
+    close(fd);
+}
+
+static void drop_caches(void) {
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1)
+        printf("  (could not drop caches, reads are cached)\n");
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * On a compress mount: shrinking a written cluster to a block boundary must
+ * not leave the old LZ4 data past EOF to be read back once it grows again
+ */
+void test_truncate_compressed(char *path) {
+    int fd, i, zeros = 0;
+    ssize_t res;
+    char buf[4096];
+
+    unlink(path);
+    fd = open(path, O_CREAT|O_RDWR, 0644);
+    memset(buf, 'x', sizeof(buf));
+    res = pwrite(fd, buf, sizeof(buf), 0);
+    fsync(fd);
+    ftruncate(fd, 1024);
+    fsync(fd);
+    close(fd);
+    drop_caches();
+
+    fd = open(path, O_RDWR);
+    ftruncate(fd, sizeof(buf));
+    res = pread(fd, buf, sizeof(buf), 0);
+    for (i = 1024; i < res; i++)
+        zeros += !buf[i];
+    printf("compressed pread after truncate and grow: %ld, %d of %ld zero bytes\n", res, zeros, res - 1024);
+    close(fd);
+}
+
+/**
+ * A clone shares the blocks, writing to it must leave the source alone
+ */
+void test_clone(char *path) {
+    int src, dst;
+    char clone_path[256], buf[sizeof(str)];
+
+    snprintf(clone_path, sizeof(clone_path), "%s.clone", path);
+    src = open(path, O_CREAT|O_RDWR|O_TRUNC, 0644);
+    dst = open(clone_path, O_CREAT|O_RDWR|O_TRUNC, 0644);
+    pwrite(src, str, sizeof(str), 0);
+    printf("FICLONE: %d\n", ioctl(dst, FICLONE, src));
+    pwrite(dst, "J", 1, 0);
+    fsync(dst);
+    pread(src, buf, sizeof(buf), 0);
+    printf("source after write to clone: %s\n", buf);
+    pread(dst, buf, sizeof(buf), 0);
+    printf("clone: %s\n", buf);
+    printf("copy_file_range: %ld\n", copy_file_range(src, NULL, dst, NULL, sizeof(str), 0));
+    close(src);
+    close(dst);
+    unlink(clone_path);
+}
+
+/**
+ * Stores through a shared mapping must reach the file
+ */
+void test_mmap(char *path) {
+    int fd;
+    char *map, buf[sizeof(str)];
+
+    fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0644);
+    ftruncate(fd, 1024);
+    map = mmap(NULL, 1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("mmap failed\n");
+        close(fd);
+        return;
+    }
+    memcpy(map, str, sizeof(str));
+    printf("msync: %d\n", msync(map, 1024, MS_SYNC));
+    munmap(map, 1024);
+    pread(fd, buf, sizeof(buf), 0);
+    printf("pread after mmap store: %s\n", buf);
+    close(fd);
+}
+
+#define STORM_THREADS 8
+#define STORM_ROUNDS 200
+
+static void *storm_worker(void *arg) {
+    long id = (long)arg, errors = 0;
+    int i, fd;
+    char fn[64], buf[600];
+
+    memset(buf, 'a' + id, sizeof(buf));
+    for (i = 0; i < STORM_ROUNDS; i++) {
+        snprintf(fn, sizeof(fn), "%s/s%ld_%d", dir, id, i);
+        fd = open(fn, O_CREAT|O_WRONLY, 0644);
+        if (fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf))
+            errors++;
+        if (fd >= 0)
+            close(fd);
+        if (unlink(fn) < 0)
+            errors++;
+    }
+    return (void *)errors;
+}
+
+/**
+ * Concurrent create/write/unlink from many threads, nothing must be left behind
+ */
+void test_create_unlink_storm(char *dir) {
+    pthread_t threads[STORM_THREADS];
+    long i, errors = 0, left = 0;
+    void *res;
+    DIR *d;
+    struct dirent *de;
+
+    for (i = 0; i < STORM_THREADS; i++)
+        pthread_create(&threads[i], NULL, storm_worker, (void *)i);
+    for (i = 0; i < STORM_THREADS; i++) {
+        pthread_join(threads[i], &res);
+        errors += (long)res;
+    }
+
+    d = opendir(dir);
+    while (d && (de = readdir(d)))
+        left += de->d_name[0] == 's';
+    if (d)
+        closedir(d);
+    printf("storm: %ld errors, %ld files left\n", errors, left);
+}
+
 int main(int argc, char *argv[]) {
+    char compr_path[256];
+
     printf("Test suit\n");
 
     //test_fwrite_fread(path);
     test_pwrite_pread(path);
+    test_fallocate(path);
+    test_sparse(path);
+    test_truncate(path);
+    if (argc > 1) {     // a second, -o compress mount
+        snprintf(compr_path, sizeof(compr_path), "%s/test.txt", argv[1]);
+        test_truncate_compressed(compr_path);
+    }
+    test_clone(path);
+    test_mmap(path);
+    test_create_unlink_storm(dir);
     return 0;
 }